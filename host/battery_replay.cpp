@@ -0,0 +1,264 @@
+// Replays battery voltage traces through the estimator BatteryTask runs and through the one it
+// replaced, and scores how far each strays from the true state of charge, how long each takes
+// to settle after start-up and charger changes, and how often the reported percentage moves.
+//
+//   battery_replay [-p period_ms] [-h hours] [-n noise_mv] [-s seed] [trace.csv ...]
+//
+// Without files a synthetic trace is generated: a cell that discharges faster while the LEDs
+// are lit, is charged part way through, and is read with noise, load sag, spikes and CHRG
+// glitches. A recorded trace is CSV with one reading per line: t_ms,mV,charging[,leds[,pct]].
+// The optional last column is the true percentage, e.g. from a coulomb counter; without it
+// only the reported changes are scored.
+
+#include "gauge.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// Within this many points of the truth counts as settled, once it has stayed there SETTLED_US
+constexpr double TOL_PCT = 3.0;
+constexpr int64_t SETTLED_US = 60LL * 1000 * 1000;
+
+struct Reading {
+    gauge::Sample x;
+    double truth;   // negative when unknown
+    bool charger;   // actually on the charger; a recorded trace only has CHRG to go by
+};
+
+struct Options {
+    int64_t periodUs = 1000 * 1000;
+    double hours = 6;
+    double noiseMv = 15;
+    uint32_t seed = 1;
+};
+
+struct Result {
+    uint32_t samples = 0;
+    uint32_t scored = 0;
+    double errSum = 0;
+    double errMax = 0;
+    uint32_t within = 0;
+    uint32_t changes = 0;
+    uint32_t events = 0;
+    uint32_t unsettled = 0;
+    int64_t settleSum = 0;
+    int64_t settleMax = 0;
+};
+
+// Inverse of gauge::percentQ8: the voltage a cell at pct shows on that curve
+static double mv_at(double pct, const gauge::CurveNode *curve) {
+    if (pct <= curve[0].pct) return curve[0].mV;
+    for (uint8_t i = 1; i < gauge::CURVE_LEN; i++) {
+        const auto &L = curve[i - 1];
+        const auto &H = curve[i];
+        if (pct <= H.pct) return L.mV + (H.mV - L.mV) * (pct - L.pct) / (H.pct - L.pct);
+    }
+    return curve[gauge::CURVE_LEN - 1].mV;
+}
+
+static std::vector<Reading> synthesize(std::mt19937 &rng, const Options &opt) {
+    // Full to empty in 5 h lit and 20 h dark, empty to full in 2 h on the charger
+    constexpr double LIT_PCT_PER_S = 100.0 / (5 * 3600);
+    constexpr double DARK_PCT_PER_S = 100.0 / (20 * 3600);
+    constexpr double CHRG_PCT_PER_S = 100.0 / (2 * 3600);
+    constexpr double SAG_TAU_S = 1.0;
+
+    std::normal_distribution<double> noise(0, opt.noiseMv);
+    std::uniform_int_distribution<int64_t> lit(2 * 60, 20 * 60);
+    std::uniform_int_distribution<int64_t> glitch(1, 5);
+    std::uniform_real_distribution<double> uni(0, 1);
+
+    std::vector<Reading> out;
+    const double dt = opt.periodUs / 1e6;
+    double pct = 85;
+    bool charging = false;
+    bool plugged = false;   // charged once already
+    bool leds = true;
+    double sag = gauge::LED_SAG_MV;
+    int64_t ledsUntil = lit(rng) * 1000 * 1000;
+    int64_t glitchUntil = -1;
+    const int64_t end = (int64_t)(opt.hours * 3600 * 1e6);
+    for (int64_t t = 0; t < end; t += opt.periodUs) {
+        if (t >= ledsUntil) {
+            leds = !leds;
+            ledsUntil = t + lit(rng) * 1000 * 1000;
+        }
+        if (!plugged && !charging && pct <= 40) charging = true;
+        if (charging && pct >= 95) {
+            charging = false;
+            plugged = true;
+        }
+        pct += charging ? CHRG_PCT_PER_S * dt : -(leds ? LIT_PCT_PER_S : DARK_PCT_PER_S) * dt;
+        pct = std::clamp(pct, 0.0, 100.0);
+
+        // The cell sags under the LED rail and recovers over about a second
+        const double target = leds ? gauge::LED_SAG_MV : 0;
+        sag += (target - sag) * (1 - std::exp(-dt / SAG_TAU_S));
+        double mV = mv_at(pct, charging ? gauge::Chrg : gauge::DisChrg) - sag + noise(rng);
+        if (uni(rng) < 0.005) mV += uni(rng) < 0.5 ? 250 : -250;
+
+        // CHRG flickers now and then, a few seconds at a time
+        if (glitchUntil < 0 && uni(rng) < dt / 1200) glitchUntil = t + glitch(rng) * 1000 * 1000;
+        bool pin = charging;
+        if (glitchUntil >= 0) {
+            pin = !charging;
+            if (t >= glitchUntil) glitchUntil = -1;
+        }
+        out.push_back({ { t, (uint16_t)std::clamp(mV, 0.0, 65535.0), pin, leds }, pct, charging });
+    }
+    return out;
+}
+
+static bool load(const char *path, std::vector<Reading> &out) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        int64_t t;
+        unsigned mV;
+        int charging, leds = 1;
+        double truth = -1;
+        if (sscanf(line, "%" SCNd64 ",%u,%d,%d,%lf", &t, &mV, &charging, &leds, &truth) < 3) continue;
+        out.push_back({ { t * 1000, (uint16_t)std::min(mV, 65535u), charging != 0, leds != 0 }, truth, charging != 0 });
+    }
+    fclose(f);
+    return true;
+}
+
+// What BatteryTask did before: the curve follows CHRG as read and the percentage is smoothed
+// by a fixed shift per reading
+struct Legacy {
+    bool inited = false;
+    uint16_t ema_q8 = 0;
+
+    uint8_t step(const gauge::Sample &x) {
+        const uint16_t pct = gauge::percentQ8(x.mV, x.charging ? gauge::Chrg : gauge::DisChrg);
+        if (!inited) {
+            inited = true;
+            ema_q8 = pct;
+        } else {
+            ema_q8 += ((int32_t)pct - (int32_t)ema_q8) >> 4;
+        }
+        return (ema_q8 + 128) >> 8;
+    }
+};
+
+static void score(const std::vector<Reading> &trace, const std::vector<uint8_t> &out, Result &res) {
+    int64_t event = -1;     // waiting to settle since
+    int64_t inside = -1;    // within tolerance since
+    for (size_t i = 0; i < trace.size(); i++) {
+        const auto &r = trace[i];
+        res.samples++;
+        if (i && out[i] != out[i - 1]) res.changes++;
+        if (r.truth < 0) continue;
+
+        // Start-up and every real charger change are where an estimator has to catch up
+        if (!i || r.charger != trace[i - 1].charger) {
+            if (event >= 0) res.unsettled++;
+            event = r.x.us;
+            inside = -1;
+            res.events++;
+        }
+
+        const double err = std::fabs(out[i] - r.truth);
+        res.scored++;
+        res.errSum += err;
+        res.errMax = std::max(res.errMax, err);
+        res.within += err <= TOL_PCT;
+
+        if (err > TOL_PCT) {
+            inside = -1;
+        } else if (inside < 0) {
+            inside = r.x.us;
+        }
+        if (event >= 0 && inside >= 0 && r.x.us - inside >= SETTLED_US) {
+            const int64_t took = inside - event;
+            res.settleSum += took;
+            res.settleMax = std::max(res.settleMax, took);
+            event = -1;
+        }
+    }
+    if (event >= 0) res.unsettled++;
+}
+
+static void print(const char *name, const Result &res) {
+    const uint32_t settled = res.events - res.unsettled;
+    if (!res.scored) {
+        printf("%-8s %8" PRIu32 " %8s %8s %8s %10s %10s %9s %8" PRIu32 "\n",
+            name, res.samples, "-", "-", "-", "-", "-", "-", res.changes);
+        return;
+    }
+    printf("%-8s %8" PRIu32 " %8.2f %8.2f %7.1f%% %8.1f s %8.1f s %5" PRIu32 "/%-3" PRIu32 " %8" PRIu32 "\n",
+        name, res.samples, res.errSum / res.scored, res.errMax, 100.0 * res.within / res.scored,
+        settled ? res.settleSum / 1e6 / settled : 0.0, res.settleMax / 1e6,
+        settled, res.events, res.changes);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-p period_ms] [-h hours] [-n noise_mv] [-s seed] [trace.csv ...]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (a[0] == '-' && a[1] && !a[2] && i + 1 < argc) {
+            double v = strtod(argv[++i], nullptr);
+            switch (a[1]) {
+                case 'p': opt.periodUs = std::max((int64_t)(v * 1000), (int64_t)1000); break;
+                case 'h': opt.hours = std::max(v, 0.1); break;
+                case 'n': opt.noiseMv = std::max(v, 0.0); break;
+                case 's': opt.seed = (uint32_t)v; break;
+                default: usage(argv[0]);
+            }
+        } else if (a[0] == '-') {
+            usage(argv[0]);
+        } else {
+            files.push_back(a);
+        }
+    }
+
+    std::vector<std::vector<Reading>> traces;
+    if (files.empty()) {
+        std::mt19937 rng(opt.seed);
+        traces.push_back(synthesize(rng, opt));
+        printf("synthetic: %.1f h, a reading every %" PRId64 " ms, %.0f mV noise, seed %" PRIu32 "\n",
+            opt.hours, opt.periodUs / 1000, opt.noiseMv, opt.seed);
+    } else {
+        for (auto path : files) {
+            traces.emplace_back();
+            if (!load(path, traces.back())) return 1;
+        }
+        printf("recorded: %zu file(s)\n", files.size());
+    }
+    printf("settled within %.0f points for %" PRId64 " s\n\n", TOL_PCT, SETTLED_US / 1000000);
+
+    printf("%-8s %8s %8s %8s %8s %10s %10s %9s %8s\n",
+        "filter", "samples", "err avg", "err max", "within", "settle avg", "settle max", "settled", "changes");
+    Result legacy, estimator;
+    for (const auto &trace : traces) {
+        std::vector<uint8_t> a, b;
+        Legacy l;
+        gauge::State s = {};
+        for (const auto &r : trace) {
+            a.push_back(l.step(r.x));
+            s = gauge::step(s, r.x);
+            b.push_back(s.pct);
+        }
+        score(trace, a, legacy);
+        score(trace, b, estimator);
+    }
+    print("legacy", legacy);
+    print("gauge", estimator);
+    return 0;
+}
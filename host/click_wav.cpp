@@ -0,0 +1,108 @@
+// Renders the metronome click sounds to WAV, the way the buzzer plays them: a PWM square wave
+// at the sound's pitch whose duty follows the envelope, ticks placed by the firmware's schedule.
+//
+//   click_wav [-b bpm] [-m beats] [-s ticks_per_beat] [-t seconds] [-o dir]
+//
+// Writes accent.wav, beat.wav, sub.wav and pattern.wav, and prints how far the tick schedule
+// strays from the ideal over an hour.
+
+#include "click.hpp"
+#include "metronome.hpp"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+constexpr uint32_t RATE = 48000;
+
+// Band-limited pulse wave: only the harmonics below Nyquist, so the render doesn't alias
+static void mix(std::vector<float> &out, size_t at, const click::Sound &s) {
+    const uint32_t len = (uint64_t)click::lengthUs(s) * RATE / 1000000;
+    const int harmonics = RATE / 2 / s.hz;
+    for (uint32_t i = 0; i < len && at + i < out.size(); i++) {
+        const double d = click::dutyAt(s, (uint64_t)i * 1000000 / RATE) / 1024.0;
+        const double w = 2 * M_PI * s.hz * i / RATE;
+        double v = 0;
+        for (int k = 1; k <= harmonics; k++) {
+            v += 2 / (k * M_PI) * sin(k * M_PI * d) * cos(k * (w - M_PI * d));
+        }
+        out[at + i] += (float)v;
+    }
+}
+
+static bool write_wav(const std::string &path, const std::vector<float> &pcm) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        perror(path.c_str());
+        return false;
+    }
+    const uint32_t data = pcm.size() * 2;
+    auto u32 = [f](uint32_t v) { fwrite(&v, 4, 1, f); };
+    auto u16 = [f](uint16_t v) { fwrite(&v, 2, 1, f); };
+    fwrite("RIFF", 1, 4, f); u32(36 + data); fwrite("WAVE", 1, 4, f);
+    fwrite("fmt ", 1, 4, f); u32(16); u16(1); u16(1); u32(RATE); u32(RATE * 2); u16(2); u16(16);
+    fwrite("data", 1, 4, f); u32(data);
+    for (float v : pcm) {
+        const float c = v > 1 ? 1 : v < -1 ? -1 : v;
+        u16((uint16_t)(int16_t)lrintf(c * 32000));
+    }
+    fclose(f);
+    printf("%s: %.3f s\n", path.c_str(), (double)pcm.size() / RATE);
+    return true;
+}
+
+static std::vector<float> single(const click::Sound &s) {
+    std::vector<float> pcm((uint64_t)click::lengthUs(s) * RATE / 1000000 + RATE / 20);
+    mix(pcm, 0, s);
+    return pcm;
+}
+
+int main(int argc, char **argv) {
+    uint32_t bpm = 120;
+    uint8_t beats = 4;
+    uint8_t sub = 2;
+    uint32_t seconds = 8;
+    std::string dir = ".";
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string a = argv[i];
+        const long v = strtol(argv[i + 1], nullptr, 10);
+        if (a == "-b") bpm = v;
+        else if (a == "-m") beats = v;
+        else if (a == "-s") sub = v;
+        else if (a == "-t") seconds = v;
+        else if (a == "-o") dir = argv[i + 1];
+        else {
+            fprintf(stderr, "usage: %s [-b bpm] [-m beats] [-s ticks_per_beat] [-t seconds] [-o dir]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!bpm || !beats || !sub) return 2;
+
+    if (!write_wav(dir + "/accent.wav", single(click::ACCENT))) return 1;
+    if (!write_wav(dir + "/beat.wav", single(click::BEAT))) return 1;
+    if (!write_wav(dir + "/sub.wav", single(click::SUB))) return 1;
+
+    // Same sound choice as beat_cb, downbeat accents
+    std::vector<float> pcm((size_t)seconds * RATE);
+    for (uint32_t n = 0;; n++) {
+        const int64_t us = metronome::tickUs(n, bpm * 100, sub);
+        const size_t at = (size_t)(us * RATE / 1000000);
+        if (at >= pcm.size()) break;
+        const uint32_t pos = n % (beats * sub);
+        mix(pcm, at, pos % sub ? click::SUB : pos == 0 ? click::ACCENT : click::BEAT);
+    }
+    if (!write_wav(dir + "/pattern.wav", pcm)) return 1;
+
+    // Each tick is placed from the anchor, so the error never grows past integer rounding
+    const uint32_t ticks = (uint64_t)bpm * sub * 60;
+    const double period = 60e6 / bpm / sub;
+    double worst = 0;
+    for (uint32_t n = 0; n <= ticks; n++) {
+        worst = std::max(worst, fabs(metronome::tickUs(n, bpm * 100, sub) - n * period));
+    }
+    printf("%" PRIu32 " BPM x%u: %" PRIu32 " ticks in an hour, worst error %.3f us\n", bpm, sub, ticks, worst);
+    return 0;
+}
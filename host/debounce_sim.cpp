@@ -0,0 +1,250 @@
+// Replays switch bounce traces through each debounce algorithm the way MatrixTask scans them,
+// and reports added latency, false triggers and missed presses.
+//
+//   debounce_sim [-w window_ms] [-b bounce_ms] [-n presses] [-s seed] [trace.csv ...]
+//
+// Without files every key of the matrix gets a synthetic trace. A recorded trace is CSV with
+// one contact transition per line: t_us,row,col,level. Its ground truth is taken from the
+// trace itself: a burst of transitions closer than QUIET_US is one edge, starting at its first
+// transition, and a burst that ends where it started is noise.
+
+#include "debounce.hpp"
+#include "layout.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+constexpr int64_t SCAN_US = 1000;
+// Rows are driven one after another; the one settle per row shifts when each is sampled
+constexpr int64_t ROW_US = 5;
+constexpr int64_t QUIET_US = 10000;
+
+constexpr debounce::Algo ALGOS[] = {
+    debounce::Algo::DEFERRED,
+    debounce::Algo::EAGER,
+    debounce::Algo::EAGER_PRESS,
+};
+
+struct Edge {
+    int64_t us;
+    bool level;
+};
+
+struct Press {
+    int64_t down;
+    int64_t up;
+};
+
+struct Trace {
+    std::vector<Edge> edges;    // contact as the column sees it
+    std::vector<Press> truth;   // what the finger did
+};
+
+struct Options {
+    uint8_t window = 5;
+    int64_t bounceUs = 3000;
+    int presses = 500;
+    uint32_t seed = 1;
+};
+
+struct Result {
+    uint32_t presses = 0;
+    uint32_t missed = 0;
+    uint32_t falses = 0;
+    int64_t pressSum = 0;
+    int64_t pressMax = 0;
+    uint32_t releases = 0;
+    int64_t releaseSum = 0;
+    int64_t releaseMax = 0;
+};
+
+// Chatter around one edge: the contact flips a few times before settling on `level`
+static void bounce(std::vector<Edge> &out, std::mt19937 &rng, int64_t t, bool level, int64_t span) {
+    std::uniform_int_distribution<int> flips(0, 4);
+    int n = span ? flips(rng) * 2 : 0;
+    std::uniform_int_distribution<int64_t> at(0, span);
+    std::vector<int64_t> ts;
+    for (int i = 0; i < n; i++) ts.push_back(t + at(rng));
+    std::sort(ts.begin(), ts.end());
+    out.push_back({ t, level });
+    for (int i = 0; i < n; i++) out.push_back({ ts[i], (i & 1) ? level : !level });
+}
+
+static Trace synthesize(std::mt19937 &rng, const Options &opt) {
+    // Mostly ordinary typing, some fast taps, and rare noise spikes on an open key
+    std::uniform_int_distribution<int64_t> hold(30000, 150000);
+    std::uniform_int_distribution<int64_t> tap(opt.window * 1000 + 3000, 25000);
+    std::uniform_int_distribution<int64_t> gap(40000, 400000);
+    std::uniform_int_distribution<int64_t> spike(20, 400);
+    std::uniform_int_distribution<int> pct(0, 99);
+
+    Trace tr;
+    int64_t t = gap(rng);
+    for (int i = 0; i < opt.presses; i++) {
+        if (pct(rng) < 5) {
+            int64_t w = spike(rng);
+            tr.edges.push_back({ t, true });
+            tr.edges.push_back({ t + w, false });
+            t += w + gap(rng);
+        }
+        int64_t down = t;
+        int64_t up = down + (pct(rng) < 15 ? tap(rng) : hold(rng));
+        bounce(tr.edges, rng, down, true, opt.bounceUs);
+        bounce(tr.edges, rng, up, false, opt.bounceUs);
+        tr.truth.push_back({ down, up });
+        t = up + opt.bounceUs + gap(rng);
+    }
+    std::stable_sort(tr.edges.begin(), tr.edges.end(), [](const Edge &a, const Edge &b) {
+        return a.us < b.us;
+    });
+    return tr;
+}
+
+static void infer_truth(Trace &tr) {
+    bool level = false;
+    size_t i = 0;
+    int64_t down = 0;
+    while (i < tr.edges.size()) {
+        int64_t start = tr.edges[i].us;
+        size_t j = i;
+        while (j + 1 < tr.edges.size() && tr.edges[j + 1].us - tr.edges[j].us < QUIET_US) j++;
+        bool settled = tr.edges[j].level;
+        if (settled != level) {
+            if (settled) {
+                down = start;
+            } else {
+                tr.truth.push_back({ down, start });
+            }
+            level = settled;
+        }
+        i = j + 1;
+    }
+}
+
+static void run(const Trace &tr, debounce::Algo algo, int row, const Options &opt, Result &res) {
+    if (tr.edges.empty()) return;
+    debounce::Key k = {};
+    std::vector<Edge> out;
+    size_t e = 0;
+    bool raw = false;
+    const int64_t end = tr.edges.back().us + QUIET_US + opt.window * SCAN_US;
+    for (int64_t t = row * ROW_US; t < end; t += SCAN_US) {
+        while (e < tr.edges.size() && tr.edges[e].us <= t) raw = tr.edges[e++].level;
+        if (debounce::update(algo, k, raw, opt.window)) out.push_back({ t, k.state });
+    }
+
+    // A reported edge belongs to a true press if it lands before that press has been
+    // released for longer than the debounce itself may legitimately take
+    const int64_t slack = (opt.window + 2) * SCAN_US;
+    std::vector<bool> matched(tr.truth.size(), false);
+    size_t p = 0;
+    for (const auto &o : out) {
+        while (p < tr.truth.size() && tr.truth[p].up + slack < o.us) p++;
+        const bool inside = p < tr.truth.size() && tr.truth[p].down <= o.us;
+        if (o.level) {
+            if (inside && !matched[p]) {
+                matched[p] = true;
+                int64_t lat = o.us - tr.truth[p].down;
+                res.pressSum += lat;
+                res.pressMax = std::max(res.pressMax, lat);
+            } else {
+                res.falses++;
+            }
+        } else if (inside && o.us >= tr.truth[p].up) {
+            int64_t lat = o.us - tr.truth[p].up;
+            res.releases++;
+            res.releaseSum += lat;
+            res.releaseMax = std::max(res.releaseMax, lat);
+        }
+    }
+    res.presses += tr.truth.size();
+    for (bool m : matched) res.missed += !m;
+}
+
+static bool load(const char *path, std::vector<Trace> &traces) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        int64_t t;
+        int row, col, level;
+        if (sscanf(line, "%" SCNd64 ",%d,%d,%d", &t, &row, &col, &level) != 4) continue;
+        if (row < 0 || row >= ROWS_LEN || col < 0 || col >= COLS_LEN) {
+            fprintf(stderr, "%s: key %d,%d is outside the %dx%d matrix\n", path, row, col, ROWS_LEN, COLS_LEN);
+            continue;
+        }
+        traces[row * COLS_LEN + col].edges.push_back({ t, level != 0 });
+    }
+    fclose(f);
+    return true;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-w window_ms] [-b bounce_ms] [-n presses] [-s seed] [trace.csv ...]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (a[0] == '-' && a[1] && !a[2] && i + 1 < argc) {
+            long v = strtol(argv[++i], nullptr, 10);
+            switch (a[1]) {
+                case 'w': opt.window = (uint8_t)std::clamp(v, 1L, 255L); break;
+                case 'b': opt.bounceUs = std::max(v, 0L) * 1000; break;
+                case 'n': opt.presses = (int)std::max(v, 1L); break;
+                case 's': opt.seed = (uint32_t)v; break;
+                default: usage(argv[0]);
+            }
+        } else if (a[0] == '-') {
+            usage(argv[0]);
+        } else {
+            files.push_back(a);
+        }
+    }
+
+    std::vector<Trace> traces(ROWS_LEN * COLS_LEN);
+    if (files.empty()) {
+        std::mt19937 rng(opt.seed);
+        for (auto &tr : traces) tr = synthesize(rng, opt);
+        printf("synthetic: %dx%d keys, %d presses each, %" PRId64 " ms bounce, seed %" PRIu32 "\n",
+            ROWS_LEN, COLS_LEN, opt.presses, opt.bounceUs / 1000, opt.seed);
+    } else {
+        for (auto path : files) {
+            if (!load(path, traces)) return 1;
+        }
+        for (auto &tr : traces) {
+            std::stable_sort(tr.edges.begin(), tr.edges.end(), [](const Edge &a, const Edge &b) {
+                return a.us < b.us;
+            });
+            infer_truth(tr);
+        }
+        printf("recorded: %zu file(s)\n", files.size());
+    }
+    printf("window %u ms, scan %" PRId64 " us\n\n", opt.window, SCAN_US);
+
+    printf("%-12s %8s %7s %7s %10s %10s %10s %10s\n",
+        "algorithm", "presses", "missed", "false", "press avg", "press max", "rel avg", "rel max");
+    for (auto algo : ALGOS) {
+        Result res;
+        for (int i = 0; i < ROWS_LEN * COLS_LEN; i++) {
+            run(traces[i], algo, i / COLS_LEN, opt, res);
+        }
+        const uint32_t hits = res.presses - res.missed;
+        printf("%-12s %8" PRIu32 " %7" PRIu32 " %7" PRIu32 " %7.2f ms %7.2f ms %7.2f ms %7.2f ms\n",
+            debounce::name(algo), res.presses, res.missed, res.falses,
+            hits ? res.pressSum / 1000.0 / hits : 0.0, res.pressMax / 1000.0,
+            res.releases ? res.releaseSum / 1000.0 / res.releases : 0.0, res.releaseMax / 1000.0);
+    }
+    return 0;
+}
@@ -0,0 +1,232 @@
+// Summarizes the esp_pm_dump_locks() output a CONFIG_KEYBOARD_PM_REPORT build prints: time
+// spent in each power management mode, how often light sleep was entered, how long each lock
+// was held, and an average current estimate from the time at each clock.
+//
+//   pm_report [-s sleep_ma] [-m mhz=ma ...] [log ...]
+//
+// Reads the console log from the files or stdin. With two or more dumps the window between the
+// first and the last is reported, so start-up does not count; with one, the time since boot.
+//
+// The dumps only count time, so the current is a proxy: a per-clock figure for the chip with
+// the CPUs mostly waiting for interrupts and the radio off, overridable with -m, and -s for
+// light sleep. SLEEP is the time no lock was held, which also covers the idle ticks too short
+// to sleep through, so it is an upper bound on light sleep residency.
+//
+// pm_report_fixture.log is three dumps in the format IDF prints, a minute apart.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+// The modes esp_pm switches between, lowest first
+constexpr const char *MODES[] = { "SLEEP", "APB_MIN", "APB_MAX", "CPU_MAX" };
+constexpr size_t MODE_COUNT = sizeof(MODES) / sizeof(MODES[0]);
+
+struct Lock {
+    std::string type;
+    int64_t taken;
+    int64_t heldUs;
+};
+
+struct Dump {
+    int64_t uptimeUs = -1;
+    uint32_t mhz[MODE_COUNT] = {};
+    int64_t modeUs[MODE_COUNT] = {};
+    bool seen[MODE_COUNT] = {};
+    int64_t sleeps = -1;
+    int64_t rejects = -1;
+    std::map<std::string, Lock> locks;
+};
+
+struct Options {
+    double sleepMa = 0.24;
+    // Dual core waiting for interrupts, radio off
+    std::map<uint32_t, double> clockMa = { {40, 13.0}, {80, 22.0}, {160, 27.6}, {240, 32.9} };
+};
+
+static int mode_of(const char *name) {
+    for (size_t i = 0; i < MODE_COUNT; i++) {
+        if (!strcmp(name, MODES[i])) return i;
+    }
+    return -1;
+}
+
+// Lines may carry a prefix from whatever captured the log
+static const char *find(const char *line, const char *key) {
+    const char *p = strstr(line, key);
+    return p ? p + strlen(key) : nullptr;
+}
+
+static void load(FILE *f, std::vector<Dump> &out) {
+    enum { NONE, LOCKS, MODE_STATS } section = NONE;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        const char *p;
+        if ((p = find(line, "Time since bootup:"))) {
+            out.emplace_back();
+            out.back().uptimeUs = strtoll(p, nullptr, 10);
+            section = NONE;
+            continue;
+        }
+        if (out.empty()) continue;
+        Dump &d = out.back();
+        if (find(line, "Lock stats:")) {
+            section = LOCKS;
+            continue;
+        }
+        if (find(line, "Mode stats:")) {
+            section = MODE_STATS;
+            continue;
+        }
+        if ((p = find(line, "light_sleep_counts:"))) {
+            d.sleeps = strtoll(p, nullptr, 10);
+            if ((p = find(line, "light_sleep_reject_counts:"))) d.rejects = strtoll(p, nullptr, 10);
+            section = NONE;
+            continue;
+        }
+
+        char name[32], type[32];
+        int arg, active;
+        long long taken, held;
+        unsigned mhz;
+        if (section == LOCKS) {
+            if (sscanf(line, "%31s %31s %d %d %lld %lld", name, type, &arg, &active, &taken, &held) == 6) {
+                d.locks[name] = { type, taken, held };
+            }
+        } else if (section == MODE_STATS) {
+            // The clock is printed left-aligned in three columns before the M: "40 M", "160M"
+            if (sscanf(line, "%31s %u M %lld", name, &mhz, &held) == 3) {
+                int m = mode_of(name);
+                if (m < 0) continue;
+                d.mhz[m] = mhz;
+                d.modeUs[m] = held;
+                d.seen[m] = true;
+            }
+        }
+    }
+}
+
+static double clock_ma(const Options &opt, uint32_t mhz) {
+    auto it = opt.clockMa.find(mhz);
+    if (it != opt.clockMa.end()) return it->second;
+    // Between the figures given, current goes roughly linearly with the clock
+    auto hi = opt.clockMa.lower_bound(mhz);
+    if (hi == opt.clockMa.begin()) return hi->second * mhz / hi->first;
+    auto lo = std::prev(hi);
+    if (hi == opt.clockMa.end()) return lo->second * mhz / lo->first;
+    return lo->second + (hi->second - lo->second) * (mhz - lo->first) / (hi->first - lo->first);
+}
+
+static void report(const Dump &first, const Dump &last, bool fromBoot, const Options &opt) {
+    const int64_t span = last.uptimeUs - (fromBoot ? 0 : first.uptimeUs);
+    if (span <= 0) {
+        fprintf(stderr, "no time between the first and the last dump\n");
+        return;
+    }
+    printf("window %.1f s, %.1f to %.1f s after boot\n\n",
+        span / 1e6, fromBoot ? 0.0 : first.uptimeUs / 1e6, last.uptimeUs / 1e6);
+
+    printf("%-8s %6s %10s %7s %8s\n", "mode", "clock", "time", "share", "mA");
+    double charge = 0;
+    int64_t counted = 0;
+    for (size_t m = 0; m < MODE_COUNT; m++) {
+        if (!last.seen[m]) continue;
+        const int64_t us = last.modeUs[m] - (fromBoot ? 0 : first.modeUs[m]);
+        const double ma = m == 0 ? opt.sleepMa : clock_ma(opt, last.mhz[m]);
+        charge += ma * us;
+        counted += us;
+        printf("%-8s %5" PRIu32 "M %8.1f s %6.1f%% %8.2f\n",
+            MODES[m], last.mhz[m], us / 1e6, 100.0 * us / span, ma);
+    }
+    if (!counted) {
+        printf("no mode stats; is CONFIG_PM_PROFILING on?\n");
+        return;
+    }
+    const double avg = charge / counted;
+    printf("\naverage %.2f mA, %.0f mAh a day, radio not included\n", avg, avg * 24);
+
+    if (last.sleeps >= 0) {
+        const int64_t sleeps = last.sleeps - (fromBoot || first.sleeps < 0 ? 0 : first.sleeps);
+        const int64_t rejects = last.rejects - (fromBoot || first.rejects < 0 ? 0 : first.rejects);
+        printf("light sleep entered %" PRId64 " times, %.1f/s, %" PRId64 " rejected\n",
+            sleeps, sleeps * 1e6 / span, rejects);
+    }
+
+    printf("\n%-15s %-13s %8s %10s %7s\n", "lock", "type", "taken", "held", "share");
+    for (const auto &[name, l] : last.locks) {
+        Lock base = { l.type, 0, 0 };
+        if (!fromBoot) {
+            auto it = first.locks.find(name);
+            if (it != first.locks.end()) base = it->second;
+        }
+        const int64_t held = l.heldUs - base.heldUs;
+        printf("%-15s %-13s %8" PRId64 " %8.1f s %6.1f%%\n",
+            name.c_str(), l.type.c_str(), l.taken - base.taken, held / 1e6, 100.0 * held / span);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-s sleep_ma] [-m mhz=ma ...] [log ...]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (a[0] == '-' && a[1] && !a[2] && i + 1 < argc) {
+            const char *v = argv[++i];
+            switch (a[1]) {
+                case 's': opt.sleepMa = std::max(strtod(v, nullptr), 0.0); break;
+                case 'm': {
+                    char *end;
+                    const unsigned long mhz = strtoul(v, &end, 10);
+                    if (!mhz || *end != '=') usage(argv[0]);
+                    opt.clockMa[mhz] = std::max(strtod(end + 1, nullptr), 0.0);
+                    break;
+                }
+                default: usage(argv[0]);
+            }
+        } else if (a[0] == '-') {
+            usage(argv[0]);
+        } else {
+            files.push_back(a);
+        }
+    }
+
+    std::vector<Dump> dumps;
+    if (files.empty()) {
+        load(stdin, dumps);
+    } else {
+        for (auto path : files) {
+            FILE *f = fopen(path, "r");
+            if (!f) {
+                perror(path);
+                return 1;
+            }
+            load(f, dumps);
+            fclose(f);
+        }
+    }
+
+    // A reset starts the counters over; only the dumps since the last one belong together
+    size_t from = 0;
+    for (size_t i = 1; i < dumps.size(); i++) {
+        if (dumps[i].uptimeUs < dumps[i - 1].uptimeUs) from = i;
+    }
+    if (from == dumps.size()) {
+        fprintf(stderr, "no esp_pm_dump_locks() output with CONFIG_PM_PROFILING found\n");
+        return 1;
+    }
+    if (from) printf("skipping %zu dump(s) from before the last reset\n", from);
+    printf("%zu dump(s)\n", dumps.size() - from);
+    report(dumps[from], dumps.back(), dumps.size() - from == 1, opt);
+    return 0;
+}
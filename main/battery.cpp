@@ -1,13 +1,22 @@
 #include "battery.hpp"
+#include "gauge.hpp"
+#include "led.hpp"
 
 extern "C" {
+    #include <sdkconfig.h>
     #include <freertos/FreeRTOS.h>
     #include <freertos/task.h>
     #include <esp_system.h>
+#ifdef CONFIG_KEYBOARD_BATTERY_ONESHOT
     #include <esp_adc/adc_oneshot.h>
+#else
+    #include <esp_adc/adc_continuous.h>
+#endif
     #include <esp_adc/adc_cali.h>
     #include <esp_adc/adc_cali_scheme.h>
     #include <driver/gpio.h>
+    #include <esp_timer.h>
+    #include <esp_log.h>
 }
 
 // GPIO2
@@ -19,112 +28,196 @@ extern "C" {
 
 #define CHRG_PIN GPIO_NUM_38
 
-struct CurveNode {
-    uint16_t mV;
-    float pct;
-};
-
-static constexpr CurveNode Chrg[13] {
-    {3000, 0},  {3200, 5},  {3350,10}, {3450,15}, {3550,20},
-    {3630,30},  {3700,40},  {3770,50}, {3820,60}, {3870,70},
-    {3920,80},  {4050,90},  {4200,100}
-};
-
-static constexpr CurveNode DisChrg[13] {
-    {3000, 0},  {3230, 5},  {3380,10}, {3480,15}, {3600,20},
-    {3680,30},  {3750,40},  {3820,50}, {3860,60}, {3910,70},
-    {3960,80},  {4080,90},  {4200,100}
-};
+static const char *TAG = "BATTERY";
 
 volatile BatStatus gBat;
 
-static adc_oneshot_unit_handle_t s_adc = nullptr;
 static adc_cali_handle_t s_cali = nullptr;
+static TaskHandle_t s_task = nullptr;
+static gauge::State s_gauge = {};
+static void (*s_changed)(uint8_t pct, bool charging) = nullptr;
+
+// BatteryTask wakeups and the CPU time they take, logged once a minute
+struct Load {
+    uint32_t wakeups;
+    uint32_t busyUs;
+    int64_t since;
+};
+
+static Load s_load = {};
 
 bool inline isChrging() {
     return !gpio_get_level(CHRG_PIN);
 }
 
+#ifdef CONFIG_KEYBOARD_BATTERY_ONESHOT
+static adc_oneshot_unit_handle_t s_adc = nullptr;
+
 static uint16_t readVolts() {
     const uint8_t N = 8;
-    uint32_t sum = 0;
-    uint32_t vmin = UINT32_MAX;
-    uint32_t vmax = 0;
-
+    gauge::Trim trim;
     for (uint8_t i = 0; i < N; ++i) {
         auto raw = 0;
         ESP_ERROR_CHECK(adc_oneshot_read(s_adc, ADC_CHANNEL, &raw));
         auto mv = 0;
         ESP_ERROR_CHECK(adc_cali_raw_to_voltage(s_cali, raw, &mv));
-        uint32_t mV = (uint16_t)mv;
-        sum += mV;
-        if (mV < vmax) vmin = mV;
-        if (mV > vmin) vmax = mV;
+        trim.add((uint16_t)mv);
     }
 
-    sum -= vmin;
-    sum -= vmax;
-    uint32_t avg = sum / (N - 2);
-    uint32_t vbat = (avg * BAT_DIV_NUM) / BAT_DIV_DEN;
+    uint32_t vbat = ((uint32_t)trim.mean() * BAT_DIV_NUM) / BAT_DIV_DEN;
     if (vbat > 65535) vbat = 65535;
     return (uint16_t)vbat;
 }
 
-static uint8_t readPct(uint16_t mV, bool isChrging) {
-    auto curve = isChrging ? Chrg : DisChrg;
-    auto len = 13;
-    if (mV <= curve[0].mV) {
-        return curve[0].pct;
-    }
-    if (mV >= curve[len - 1].mV) {
-        return curve[len - 1].pct;
-    }
+static void setupAdc() {
+    adc_oneshot_unit_init_cfg_t unit_cfg = {};
+    unit_cfg.unit_id = ADC_UNIT_1;
+    ESP_ERROR_CHECK(adc_oneshot_new_unit(&unit_cfg, &s_adc));
 
-    uint16_t lo = 0, hi = len - 1;
-    while (hi - lo > 1) {
-        auto mid = (lo + hi) >> 1;
-        if (mV < curve[mid].mV) {
-            hi = mid;
-        } else {
-            lo = mid;
-        }
+    adc_oneshot_chan_cfg_t chan_cfg = {};
+    chan_cfg.atten = ADC_ATTEN;
+    chan_cfg.bitwidth = ADC_BITWIDTH;
+    ESP_ERROR_CHECK(adc_oneshot_config_channel(s_adc, ADC_CHANNEL, &chan_cfg));
+}
+
+static uint16_t nextVolts(int64_t &woke) {
+    static TickType_t last = xTaskGetTickCount();
+    vTaskDelayUntil(&last, pdMS_TO_TICKS(100));
+    woke = esp_timer_get_time();
+    return readVolts();
+}
+#else
+#ifdef CONFIG_PM_ENABLE
+// The driver holds an APB_FREQ_MAX lock while it converts, which also keeps the chip out of
+// light sleep, so each period is one short burst: about 13 ms of lock
+constexpr uint32_t SAMPLE_HZ = 20000;
+constexpr uint32_t FRAME_SAMPLES = 256;
+#else
+// DMA fills frames in the background; the task only runs once a whole frame is in
+constexpr uint32_t SAMPLE_HZ = CONFIG_KEYBOARD_BATTERY_SAMPLE_HZ;
+constexpr uint32_t FRAME_SAMPLES = CONFIG_KEYBOARD_BATTERY_FRAME_SAMPLES;
+#endif
+constexpr uint32_t FRAME_BYTES = FRAME_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES;
+
+static adc_continuous_handle_t s_adc = nullptr;
+static uint8_t s_frame[FRAME_BYTES];
+
+static bool IRAM_ATTR conv_done(adc_continuous_handle_t, const adc_continuous_evt_data_t*, void*) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(s_task, &woken);
+    return woken == pdTRUE;
+}
+
+// The whole frame is averaged in raw counts, then calibrated once
+static uint16_t readFrame(uint32_t len) {
+    gauge::Trim trim;
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= len; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        auto *p = (adc_digi_output_data_t*)&s_frame[i];
+        if (p->type2.channel != ADC_CHANNEL) continue;
+        trim.add(p->type2.data);
     }
-    const auto &H = curve[lo];
-    const auto &L = curve[hi];
+    if (!trim.n) return gBat.last_mV;
+    auto mv = 0;
+    ESP_ERROR_CHECK(adc_cali_raw_to_voltage(s_cali, trim.mean(), &mv));
+    uint32_t vbat = ((uint32_t)mv * BAT_DIV_NUM) / BAT_DIV_DEN;
+    if (vbat > 65535) vbat = 65535;
+    return (uint16_t)vbat;
+}
 
-    uint32_t span_mv = H.mV - L.mV;
-    uint32_t off_mv = mV - L.mV;
-    uint32_t span_pct_q8 = (uint32_t)(H.pct - L.pct) * 256;
-    uint32_t interp_q8 = span_pct_q8 * off_mv / span_mv;
-    uint32_t pct_q8 = (uint32_t)L.pct * 256 + interp_q8;
+static void setupAdc() {
+    adc_continuous_handle_cfg_t handle_cfg = {};
+    handle_cfg.max_store_buf_size = FRAME_BYTES * 2;
+    handle_cfg.conv_frame_size = FRAME_BYTES;
+    handle_cfg.flags.flush_pool = true;
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_cfg, &s_adc));
+
+    adc_digi_pattern_config_t pattern = {};
+    pattern.atten = ADC_ATTEN;
+    pattern.channel = ADC_CHANNEL;
+    pattern.unit = ADC_UNIT_1;
+    pattern.bit_width = ADC_BITWIDTH;
+
+    adc_continuous_config_t cfg = {};
+    cfg.pattern_num = 1;
+    cfg.adc_pattern = &pattern;
+    cfg.sample_freq_hz = SAMPLE_HZ;
+    cfg.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+    cfg.format = ADC_DIGI_OUTPUT_FORMAT_TYPE2;
+    ESP_ERROR_CHECK(adc_continuous_config(s_adc, &cfg));
+
+    adc_continuous_evt_cbs_t cbs = {};
+    cbs.on_conv_done = conv_done;
+    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(s_adc, &cbs, nullptr));
+#ifndef CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(adc_continuous_start(s_adc));
+#endif
+}
 
-    return (uint8_t)((pct_q8 + 128u) >> 8);
+static uint16_t nextVolts(int64_t &woke) {
+#ifdef CONFIG_PM_ENABLE
+    // The first burst goes right away so the level is known from boot
+    static TickType_t last = xTaskGetTickCount();
+    static bool sampled = false;
+    if (sampled) vTaskDelayUntil(&last, pdMS_TO_TICKS(CONFIG_KEYBOARD_BATTERY_PERIOD_S * 1000));
+    sampled = true;
+    ESP_ERROR_CHECK(adc_continuous_flush_pool(s_adc));
+    ulTaskNotifyTake(pdTRUE, 0);
+    ESP_ERROR_CHECK(adc_continuous_start(s_adc));
+#endif
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    woke = esp_timer_get_time();
+    // Take the newest frame; with flush_pool any backlog was already dropped
+    uint32_t len = 0;
+    uint16_t mV = gBat.last_mV;
+    while (adc_continuous_read(s_adc, s_frame, FRAME_BYTES, &len, 0) == ESP_OK) {
+        mV = readFrame(len);
+    }
+#ifdef CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(adc_continuous_stop(s_adc));
+#endif
+    return mV;
+}
+#endif
+
+static void account(int64_t woke) {
+    const int64_t now = esp_timer_get_time();
+    s_load.wakeups++;
+    s_load.busyUs += now - woke;
+    if (now - s_load.since >= 60 * 1000 * 1000) {
+        ESP_LOGI(
+            TAG, "%" PRIu32 " wakeups, %" PRIu32 " us CPU in the last minute; %u mV, %u%%",
+            s_load.wakeups, s_load.busyUs, gBat.last_mV, gBat.avgPct
+        );
+        s_load = { 0, 0, now };
+    }
 }
 
 static void BatteryTask(void*) {
-    const TickType_t interval = pdMS_TO_TICKS(100);
-    TickType_t last = xTaskGetTickCount();
+    // Created here so the handle exists before the first read, and s_task before the first frame
+    setupAdc();
+    s_load.since = esp_timer_get_time();
+    uint8_t sent_pct = UINT8_MAX;
+    bool sent_chrg = false;
     for (;;) {
-        auto chrging = isChrging();
-        gBat.isChrging = chrging;
-
-        auto mV = readVolts();
-        auto pct = readPct(mV, chrging);
-        if (!gBat.inited) {
-            gBat.inited = true;
-            gBat.ema_q8 = pct * 256;
-            gBat.avgPct = pct;
-        } else {
-            int32_t delta = (int32_t)(pct * 256) - (int32_t)gBat.ema_q8;
-            gBat.ema_q8 = (uint16_t)((int32_t)gBat.ema_q8 + (delta >> 4)); // EMA_SHIFT=4
-            gBat.avgPct = (uint8_t)((gBat.ema_q8 + 128) >> 8);
-        }
+        int64_t woke = 0;
+        auto mV = nextVolts(woke);
+        s_gauge = gauge::step(s_gauge, { woke, mV, isChrging(), !gFillDark });
+
+        gBat.isChrging = s_gauge.charging;
+        gBat.avgPct = s_gauge.pct;
         gBat.last_mV = mV;
-        vTaskDelayUntil(&last, interval);
+        gBat.inited = true;
+        if (s_changed && (s_gauge.pct != sent_pct || s_gauge.charging != sent_chrg)) {
+            sent_pct = s_gauge.pct;
+            sent_chrg = s_gauge.charging;
+            s_changed(sent_pct, sent_chrg);
+        }
+        account(woke);
     }
 }
 
-void setupBattery()  {
+void setupBattery(void (*changed)(uint8_t pct, bool charging))  {
+    s_changed = changed;
     gpio_reset_pin(CHRG_PIN);
     gpio_config_t io = {
         .pin_bit_mask = 1ULL << CHRG_PIN,
@@ -135,15 +228,6 @@ void setupBattery()  {
     };
     gpio_config(&io);
 
-    adc_oneshot_unit_init_cfg_t unit_cfg = {};
-    unit_cfg.unit_id = ADC_UNIT_1;
-    ESP_ERROR_CHECK(adc_oneshot_new_unit(&unit_cfg, &s_adc));
-
-    adc_oneshot_chan_cfg_t chan_cfg = {};
-    chan_cfg.atten = ADC_ATTEN;
-    chan_cfg.bitwidth = ADC_BITWIDTH;
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(s_adc, ADC_CHANNEL, &chan_cfg));
-
     adc_cali_curve_fitting_config_t cali_cfg = {};
     cali_cfg.unit_id = ADC_UNIT_1;
     cali_cfg.atten = ADC_ATTEN;
@@ -153,10 +237,10 @@ void setupBattery()  {
     xTaskCreatePinnedToCore(
         BatteryTask,
         "BatteryTask",
-        2048,
+        3072,
         nullptr,
         1,
-        nullptr,
+        &s_task,
         tskNO_AFFINITY
     );
 }
@@ -3,7 +3,6 @@
 
 struct BatStatus {
     uint16_t last_mV = 0;
-    uint16_t ema_q8 = 0;
     uint8_t avgPct = 0;
     bool isChrging = false;
     bool inited = false;
@@ -11,4 +10,5 @@ struct BatStatus {
 
 extern volatile BatStatus gBat;
 
-void setupBattery();
+// changed() runs on BatteryTask whenever the reported percentage or charging state moves
+void setupBattery(void (*changed)(uint8_t pct, bool charging));
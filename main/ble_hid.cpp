@@ -1,10 +1,15 @@
 #include "ble_hid.hpp"
 
 extern "C" {
+    #include <freertos/FreeRTOS.h>
+    #include <freertos/semphr.h>
     #include <nvs_flash.h>
     #include <esp_bt.h>
     #include <esp_hidd.h>
     #include <esp_log.h>
+    #include <esp_timer.h>
+    #include <esp_attr.h>
+    #include <sdkconfig.h>
 
     #include "host/ble_hs.h"
     #include "host/ble_store.h"
@@ -13,26 +18,116 @@ extern "C" {
     void ble_store_config_init(void);
 }
 
+#include <atomic>
+
 namespace ble_hid {
 
 static const char *TAG = "BLE_HID";
 
 static bool active = false;
 static bool mounted = false;
+// The protocol the host set, on the esp_event task; HidTask takes it into boot on a replay
+static std::atomic<bool> host_boot{false};
+static bool boot = false;
+static void (*s_protocol)() = nullptr;
+// Stack is up but the link is held back while USB carries the keys
+static bool parked = false;
+static uint16_t conn_handle = BLE_HS_CONN_HANDLE_NONE;
+
+// Supervision timeouts in 10 ms units
+constexpr uint16_t ACTIVE_TIMEOUT = 400;    // 4 s
+constexpr uint16_t IDLE_TIMEOUT = 600;      // 6 s
+
+static_assert(
+    CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MIN <= CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MAX,
+    "KEYBOARD_BLE_ACTIVE_ITVL_MIN is above KEYBOARD_BLE_ACTIVE_ITVL_MAX"
+);
+// The spec wants the timeout above (1 + latency) * interval * 2; 10 ms units against 1.25 ms ones
+static_assert(
+    ACTIVE_TIMEOUT * 4 > CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MAX,
+    "KEYBOARD_BLE_ACTIVE_ITVL_MAX is too long for the active supervision timeout"
+);
+static_assert(
+    IDLE_TIMEOUT * 4 > (1 + CONFIG_KEYBOARD_BLE_IDLE_LATENCY) * CONFIG_KEYBOARD_BLE_IDLE_ITVL,
+    "KEYBOARD_BLE_IDLE_ITVL and KEYBOARD_BLE_IDLE_LATENCY outlast the idle supervision timeout"
+);
+
+// Connection parameters: a short interval while typing, a long one with slave latency when idle
+static const ble_gap_upd_params regime_params[] = {
+    {   // Regime::ACTIVE
+        .itvl_min = CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MIN,
+        .itvl_max = CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MAX,
+        .latency = 0,
+        .supervision_timeout = ACTIVE_TIMEOUT,
+        .min_ce_len = 0,
+        .max_ce_len = 0,
+    },
+    {   // Regime::IDLE
+        .itvl_min = CONFIG_KEYBOARD_BLE_IDLE_ITVL,
+        .itvl_max = CONFIG_KEYBOARD_BLE_IDLE_ITVL,
+        .latency = CONFIG_KEYBOARD_BLE_IDLE_LATENCY,
+        .supervision_timeout = IDLE_TIMEOUT,
+        .min_ce_len = 0,
+        .max_ce_len = 0,
+    },
+};
+
+static const char *regime_str[] = { "active", "idle" };
 
-static uint8_t modifiers = 0;
-static uint8_t keycodes[5] = {0};
-static uint8_t keycodes_len = sizeof(keycodes) / sizeof(keycodes[0]);
+static Regime regime = Regime::ACTIVE;   // last requested
+static Regime inflight = Regime::ACTIVE; // sent to the central, answer pending
+static Regime applied = Regime::ACTIVE;  // last confirmed by the central
+static bool regime_pending = false;
+// Regimes the central turned down, a bit each; not asked for again on this connection
+static uint8_t regime_rejected = 0;
+static int64_t regime_since = 0;
+static Stats s_stats = {};
+
+// Unplug-to-first-keystroke benchmark, armed by setup() or resume
+static int64_t resume_us = 0;
+static bool resume_pending = false;
 static esp_hidd_dev_t *hid_dev;
 
+// setup(), end() and park() change hid_dev and the reports on LinkTask while send() uses them
+// from HidTask and battery() from BatteryTask
+static StaticSemaphore_t dev_mutex_buf;
+static SemaphoreHandle_t dev_mutex = xSemaphoreCreateMutexStatic(&dev_mutex_buf);
+// The regime is asked for from HidTask and LinkTask and answered on the NimBLE host task. It has
+// a lock of its own because end() holds dev_mutex while it waits for the host task to stop.
+static StaticSemaphore_t regime_mutex_buf;
+static SemaphoreHandle_t regime_mutex = xSemaphoreCreateMutexStatic(&regime_mutex_buf);
+
+struct Lock {
+    explicit Lock(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+    ~Lock() { xSemaphoreGive(m); }
+    SemaphoreHandle_t m;
+};
+
+// Last level handed to the Battery Service, kept across end() so a new link starts out right.
+// Unknown until the gauge has its first reading, and not set until then.
+constexpr uint8_t BAT_UNKNOWN = UINT8_MAX;
+static uint8_t bat_pct = BAT_UNKNOWN;
+static bool bat_charging = false;
+static uint16_t bat_handle = 0;
+static const ble_uuid16_t bas_svc_uuid = BLE_UUID16_INIT(0x180F);
+static const ble_uuid16_t bas_level_uuid = BLE_UUID16_INIT(0x2A19);
+
 #define GATT_SVR_SVC_HID_UUID 0x1812
 static struct ble_hs_adv_fields fields;
 
-const unsigned char keyboardReportMap[] = { //7 bytes input (modifiers, resrvd, keys*5), 1 byte output
+#define REPORT_ID_KEYBOARD 1
+#define REPORT_ID_CONSUMER 2
+
+// Bitmap over usages 0x00..0x97: modifiers plus 19 bytes is 20 bytes, which still
+// fits a notification at the default ATT MTU of 23
+constexpr uint8_t NKRO_USAGES = 0x98;
+constexpr uint8_t NKRO_BYTES = NKRO_USAGES / 8;
+
+const unsigned char keyboardReportMap[] = { // 20 bytes input (modifiers, usage bitmap), 1 byte output; 2 bytes consumer input
     0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
     0x09, 0x06,        // Usage (Keyboard)
     0xA1, 0x01,        // Collection (Application)
-    0x85, 0x01,        //   Report ID (1)
+    0x85, REPORT_ID_KEYBOARD, //   Report ID (1)
     0x05, 0x07,        //   Usage Page (Kbrd/Keypad)
     0x19, 0xE0,        //   Usage Minimum (0xE0)
     0x29, 0xE7,        //   Usage Maximum (0xE7)
@@ -41,9 +136,6 @@ const unsigned char keyboardReportMap[] = { //7 bytes input (modifiers, resrvd,
     0x75, 0x01,        //   Report Size (1)
     0x95, 0x08,        //   Report Count (8)
     0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
-    0x95, 0x01,        //   Report Count (1)
-    0x75, 0x08,        //   Report Size (8)
-    0x81, 0x03,        //   Input (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
     0x95, 0x05,        //   Report Count (5)
     0x75, 0x01,        //   Report Size (1)
     0x05, 0x08,        //   Usage Page (LEDs)
@@ -53,17 +145,69 @@ const unsigned char keyboardReportMap[] = { //7 bytes input (modifiers, resrvd,
     0x95, 0x01,        //   Report Count (1)
     0x75, 0x03,        //   Report Size (3)
     0x91, 0x03,        //   Output (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
-    0x95, 0x05,        //   Report Count (5)
-    0x75, 0x08,        //   Report Size (8)
-    0x15, 0x00,        //   Logical Minimum (0)
-    0x25, 0x65,        //   Logical Maximum (101)
     0x05, 0x07,        //   Usage Page (Kbrd/Keypad)
     0x19, 0x00,        //   Usage Minimum (0x00)
-    0x29, 0x65,        //   Usage Maximum (0x65)
+    0x29, NKRO_USAGES - 1, // Usage Maximum (0x97)
+    0x15, 0x00,        //   Logical Minimum (0)
+    0x25, 0x01,        //   Logical Maximum (1)
+    0x75, 0x01,        //   Report Size (1)
+    0x95, NKRO_USAGES, //   Report Count (152)
+    0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+    0xC0,              // End Collection
+
+    0x05, 0x0C,        // Usage Page (Consumer)
+    0x09, 0x01,        // Usage (Consumer Control)
+    0xA1, 0x01,        // Collection (Application)
+    0x85, REPORT_ID_CONSUMER, //   Report ID (2)
+    0x15, 0x00,        //   Logical Minimum (0)
+    0x26, 0xFF, 0x03,  //   Logical Maximum (1023)
+    0x19, 0x00,        //   Usage Minimum (Unassigned)
+    0x2A, 0xFF, 0x03,  //   Usage Maximum (0x3FF)
+    0x75, 0x10,        //   Report Size (16)
+    0x95, 0x01,        //   Report Count (1)
     0x81, 0x00,        //   Input (Data,Array,Abs,No Wrap,Linear,Preferred State,No Null Position)
     0xC0,              // End Collection
 
-    // 65 bytes
+    // 84 bytes
+};
+
+// Keyboard usages that hosts only honour on the consumer page
+struct ConsumerKey {
+    uint8_t key;
+    uint16_t usage;
+};
+
+static constexpr ConsumerKey ConsumerKeys[] = {
+    {0x7F, 0x00E2},    // Mute
+    {0x80, 0x00E9},    // Volume Up
+    {0x81, 0x00EA},    // Volume Down
+};
+
+// The bits of those keys, which stay clear in the keyboard report
+struct NkroMask {
+    uint8_t bits[NKRO_BYTES];
+};
+
+static constexpr NkroMask ConsumerMask = [] {
+    NkroMask m = {};
+    for (const auto &c : ConsumerKeys) m.bits[c.key >> 3] |= 1 << (c.key & 7);
+    return m;
+}();
+
+// Input reports are kept encoded and patched in place; flush() only sends the dirty ones
+static uint8_t kbd_report[1 + NKRO_BYTES] = {0};
+static uint8_t consumer_report[2] = {0};
+
+struct InputReport {
+    uint8_t id;
+    uint8_t *data;
+    uint8_t len;
+    bool dirty;
+};
+
+static InputReport reports[] = {
+    { REPORT_ID_KEYBOARD, kbd_report, sizeof(kbd_report), false },
+    { REPORT_ID_CONSUMER, consumer_report, sizeof(consumer_report), false },
 };
 
 static esp_hid_raw_report_map_t ble_report_maps[] = {
@@ -84,6 +228,77 @@ static esp_hid_device_config_t ble_hid_config = {
     .report_maps_len    = 1
 };
 
+enum class Adv : uint8_t {
+    DIRECTED,
+    ACCEPT_LIST,
+    GENERAL,
+};
+
+static const char *adv_str[] = { "directed", "accept-list", "general" };
+
+constexpr int32_t ADV_DIRECTED_MS = 1280;   // controller limit for high duty cycle
+constexpr int32_t ADV_ACCEPT_LIST_MS = 10 * 1000;
+constexpr int32_t ADV_GENERAL_MS = 30 * 1000;
+constexpr uint8_t ADV_BACKOFF_MAX = 4;      // up to 480-800 ms, then forever
+
+static Adv adv = Adv::GENERAL;
+static uint8_t adv_backoff = 0;
+// Kept through deep sleep; after any other reset the newest bond stands in for it
+RTC_DATA_ATTR static ble_addr_t last_peer;
+RTC_DATA_ATTR static bool has_last_peer = false;
+static int64_t reconnect_us = 0;
+
+static void adv_start(Adv phase);
+
+static void account_regime() {
+    int64_t now = esp_timer_get_time();
+    if (regime_since) s_stats.regimeUs[(uint8_t)applied] += now - regime_since;
+    regime_since = now;
+}
+
+// Where parameters the central chose itself fall; latency or a long interval is the idle kind
+static Regime classify(const ble_gap_conn_desc &desc) {
+    const bool active = !desc.conn_latency && desc.conn_itvl <= CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MAX;
+    return active ? Regime::ACTIVE : Regime::IDLE;
+}
+
+static void record_params(const ble_gap_conn_desc &desc) {
+    s_stats.itvl = desc.conn_itvl;
+    s_stats.latency = desc.conn_latency;
+    s_stats.timeout = desc.supervision_timeout;
+    ESP_LOGI(
+        TAG,
+        "%s: itvl=%u.%02u ms latency=%u timeout=%u ms; "
+        "%llu s active, %llu s idle so far",
+        regime_str[(uint8_t)applied],
+        desc.conn_itvl * 125 / 100, desc.conn_itvl * 125 % 100,
+        desc.conn_latency,
+        desc.supervision_timeout * 10,
+        s_stats.regimeUs[0] / 1000000, s_stats.regimeUs[1] / 1000000
+    );
+}
+
+// Callers hold regime_mutex
+static void request_regime(Regime r) {
+    regime = r;
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE || regime_pending) return;
+    if (regime_rejected & (1 << (uint8_t)r)) return;
+    int rc = ble_gap_update_params(conn_handle, &regime_params[(uint8_t)r]);
+    if (rc == 0) {
+        inflight = r;
+        regime_pending = true;
+    } else {
+        ESP_LOGW(TAG, "%s params not requested; rc=%d", regime_str[(uint8_t)r], rc);
+    }
+}
+
+// HidTask asks for the active regime with every report and LinkTask for the idle one while
+// nothing is typed, so only a change goes out
+static void want_regime(Regime r) {
+    Lock lock(regime_mutex);
+    if (regime != r) request_regime(r);
+}
+
 static int nimble_hid_gap_event(struct ble_gap_event *event, void *arg) {
     struct ble_gap_conn_desc desc;
     struct ble_sm_io pkey;
@@ -98,23 +313,58 @@ static int nimble_hid_gap_event(struct ble_gap_event *event, void *arg) {
                 event->connect.status == 0 ? "established" : "failed",
                 event->connect.status
             );
+            if (event->connect.status == 0) {
+                Lock lock(regime_mutex);
+                conn_handle = event->connect.conn_handle;
+                if (ble_gap_conn_find(conn_handle, &desc) == 0) {
+                    applied = classify(desc);
+                    record_params(desc);
+                } else {
+                    applied = Regime::ACTIVE;
+                }
+                regime_pending = false;
+                regime_rejected = 0;
+                regime_since = esp_timer_get_time();
+            }
             break;
         
-        case BLE_GAP_EVENT_DISCONNECT:
+        case BLE_GAP_EVENT_DISCONNECT: {
             ESP_LOGI(
                 TAG,
                 "disconnect; reason=%d", event->disconnect.reason
             );
+            Lock lock(regime_mutex);
+            conn_handle = BLE_HS_CONN_HANDLE_NONE;
+            account_regime();
+            regime_since = 0;
             break;
+        }
         
-        case BLE_GAP_EVENT_CONN_UPDATE:
+        case BLE_GAP_EVENT_CONN_UPDATE: {
             /* The central has updated the connection parameters. */
             ESP_LOGI(
                 TAG,
                 "connection updated; status=%d",
                 event->conn_update.status
             );
+            Lock lock(regime_mutex);
+            const bool requested = regime_pending;
+            regime_pending = false;
+            if (event->conn_update.status == 0 &&
+                ble_gap_conn_find(event->conn_update.conn_handle, &desc) == 0) {
+                account_regime();
+                // An update nobody here asked for is the central's own choice
+                applied = requested ? inflight : classify(desc);
+                record_params(desc);
+            } else if (event->conn_update.status != 0 && requested) {
+                // Asking again would only be turned down again
+                regime_rejected |= 1 << (uint8_t)inflight;
+                ESP_LOGW(TAG, "%s params rejected; keeping the current ones", regime_str[(uint8_t)inflight]);
+            }
+            // Activity or idleness may have changed while the last update was in flight
+            if (regime != inflight) request_regime(regime);
             break;
+        }
         
         case BLE_GAP_EVENT_ADV_COMPLETE:
             ESP_LOGI(
@@ -122,6 +372,11 @@ static int nimble_hid_gap_event(struct ble_gap_event *event, void *arg) {
                 "advertise complete; reason=%d",
                 event->adv_complete.reason
             );
+            if (event->adv_complete.reason == BLE_HS_ETIMEOUT &&
+                conn_handle == BLE_HS_CONN_HANDLE_NONE && !parked) {
+                if (adv == Adv::GENERAL) adv_backoff++;
+                adv_start(adv == Adv::DIRECTED ? Adv::ACCEPT_LIST : Adv::GENERAL);
+            }
             break;
         
         case BLE_GAP_EVENT_SUBSCRIBE:
@@ -156,8 +411,27 @@ static int nimble_hid_gap_event(struct ble_gap_event *event, void *arg) {
                 "encryption change event; status=%d ",
                 event->enc_change.status
             );
-            ble_gap_conn_find(event->enc_change.conn_handle, &desc);
+            if (event->enc_change.status != 0 ||
+                ble_gap_conn_find(event->enc_change.conn_handle, &desc) != 0) {
+                break;
+            }
             mounted = true;
+            {
+                Lock lock(regime_mutex);
+                request_regime(Regime::ACTIVE);
+            }
+            if (desc.sec_state.bonded) {
+                last_peer = desc.peer_id_addr;
+                has_last_peer = true;
+            }
+            if (reconnect_us) {
+                s_stats.reconnectMs = (esp_timer_get_time() - reconnect_us) / 1000;
+                reconnect_us = 0;
+                ESP_LOGI(TAG, "reconnected in %" PRIu32 " ms via %s advertising", s_stats.reconnectMs, adv_str[(uint8_t)adv]);
+            }
+            if (resume_pending) {
+                ESP_LOGI(TAG, "link up %lld ms after resume", (esp_timer_get_time() - resume_us) / 1000);
+            }
             break;
         
         case BLE_GAP_EVENT_NOTIFY_TX:
@@ -228,35 +502,100 @@ static int nimble_hid_gap_event(struct ble_gap_event *event, void *arg) {
     return 0;
 }
 
-static void esp_hid_ble_gap_adv_start() {
+static void adv_start(Adv phase) {
     int rc;
     struct ble_gap_adv_params adv_params;
+    const ble_addr_t *peer = nullptr;
+    int32_t duration = BLE_HS_FOREVER;
 
-    rc = ble_gap_adv_set_fields(&fields);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "error setting advertisement data; rc=%d\n", rc);
-        return;
+    adv = phase;
+    memset(&adv_params, 0, sizeof(adv_params));
+    switch (phase) {
+        case Adv::DIRECTED:
+            /* High duty cycle, straight at the host we were last bonded with */
+            adv_params.conn_mode = BLE_GAP_CONN_MODE_DIR;
+            adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;
+            adv_params.high_duty_cycle = 1;
+            peer = &last_peer;
+            duration = ADV_DIRECTED_MS;
+            break;
+
+        case Adv::ACCEPT_LIST: {
+            /* Fast, but only bonded hosts may scan or connect */
+            ble_addr_t bonded[CONFIG_BT_NIMBLE_MAX_BONDS];
+            int num = 0;
+            rc = ble_store_util_bonded_peers(bonded, &num, CONFIG_BT_NIMBLE_MAX_BONDS);
+            if (rc != 0 || num == 0 || ble_gap_wl_set(bonded, num) != 0) {
+                adv_start(Adv::GENERAL);
+                return;
+            }
+            adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+            adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+            adv_params.filter_policy = BLE_HCI_ADV_FILT_BOTH;
+            adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(20);
+            adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(30);
+            duration = ADV_ACCEPT_LIST_MS;
+            break;
+        }
+
+        case Adv::GENERAL:
+            /* Recommended interval 30ms to 50ms, backing off while nobody connects */
+            adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+            adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+            adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(30 << adv_backoff);
+            adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(50 << adv_backoff);
+            if (adv_backoff < ADV_BACKOFF_MAX) duration = ADV_GENERAL_MS;
+            break;
     }
+
+    if (phase != Adv::DIRECTED) {
+        rc = ble_gap_adv_set_fields(&fields);
+        if (rc != 0) {
+            ESP_LOGE(TAG, "error setting advertisement data; rc=%d\n", rc);
+            return;
+        }
+    }
+
     /* Begin advertising. */
-    memset(&adv_params, 0, sizeof(adv_params));
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(30); /* Recommended interval 30ms to 50ms */
-    adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(50);
-    
     rc = ble_gap_adv_start(
         BLE_OWN_ADDR_PUBLIC,
-        nullptr,
-        BLE_HS_FOREVER,
+        peer,
+        duration,
         &adv_params,
         nimble_hid_gap_event,
         nullptr
     );
 
     if (rc != 0) {
-        ESP_LOGE(TAG, "error enabling advertisement; rc=%d\n", rc);
+        ESP_LOGE(TAG, "error enabling %s advertisement; rc=%d\n", adv_str[(uint8_t)phase], rc);
+        if (phase != Adv::GENERAL) adv_start(Adv::GENERAL);
+        return;
+    }
+    ESP_LOGI(TAG, "advertising: %s", adv_str[(uint8_t)phase]);
+}
+
+// The host the board was last with, as long as it is still bonded
+static void seed_last_peer() {
+    ble_addr_t bonded[CONFIG_BT_NIMBLE_MAX_BONDS];
+    int num = 0;
+    if (ble_store_util_bonded_peers(bonded, &num, CONFIG_BT_NIMBLE_MAX_BONDS) != 0 || num == 0) {
+        has_last_peer = false;
         return;
     }
+    for (int i = 0; has_last_peer && i < num; i++) {
+        if (!ble_addr_cmp(&bonded[i], &last_peer)) return;
+    }
+    // The store appends, so the last entry is the most recent bond
+    last_peer = bonded[num - 1];
+    has_last_peer = true;
+}
+
+// Reconnect strategy: directed at the last host, then bonded hosts only, then anyone
+static void esp_hid_ble_gap_adv_start() {
+    reconnect_us = esp_timer_get_time();
+    adv_backoff = 0;
+    seed_last_peer();
+    adv_start(has_last_peer ? Adv::DIRECTED : Adv::ACCEPT_LIST);
 }
 
 static void ble_hidd_event_callback(
@@ -277,6 +616,8 @@ static void ble_hidd_event_callback(
             break;
         case ESP_HIDD_PROTOCOL_MODE_EVENT:
             ESP_LOGI(TAG, "PROTOCOL MODE[%u]: %s", param->protocol_mode.map_index, param->protocol_mode.protocol_mode ? "REPORT" : "BOOT");
+            host_boot.store(param->protocol_mode.protocol_mode == ESP_HID_PROTOCOL_MODE_BOOT, std::memory_order_release);
+            if (s_protocol) s_protocol();
             break;
         case ESP_HIDD_CONTROL_EVENT:
             ESP_LOGI(TAG, "CONTROL[%u]: %sSUSPEND", param->control.map_index, param->control.control ? "EXIT_" : "");
@@ -299,7 +640,7 @@ static void ble_hidd_event_callback(
         case ESP_HIDD_DISCONNECT_EVENT:
             ESP_LOGI(TAG, "DISCONNECT: %s", esp_hid_disconnect_reason_str(esp_hidd_dev_transport_get(param->disconnect.dev), param->disconnect.reason));
             mounted = false;
-            esp_hid_ble_gap_adv_start();
+            if (!parked) esp_hid_ble_gap_adv_start();
             break;
         case ESP_HIDD_STOP_EVENT:
             ESP_LOGI(TAG, "STOP");
@@ -315,12 +656,39 @@ void ble_hid_device_host_task(void *param) {
     nimble_port_freertos_deinit();
 }
 
-void setup(char serial_str[17]) {
-    if (active) return;
+// Standby modes keep the controller, host and bonds resident across a USB session
+#ifndef CONFIG_KEYBOARD_BLE_STANDBY_COLD
+static void resume() {
+    parked = false;
+    resume_us = esp_timer_get_time();
+    resume_pending = true;
+#if CONFIG_KEYBOARD_BLE_STANDBY_HOT
+    if (conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        ESP_LOGI(TAG, "BLE HID resumed on the parked link");
+        return;
+    }
+#endif
+    ESP_LOGI(TAG, "BLE HID resumed; advertising");
+    esp_hid_ble_gap_adv_start();
+}
+#endif
+
+void setup(char serial_str[17], void (*protocol)()) {
+    Lock lock(dev_mutex);
+    if (active) {
+#ifndef CONFIG_KEYBOARD_BLE_STANDBY_COLD
+        if (parked) resume();
+#endif
+        return;
+    }
+
+    resume_us = esp_timer_get_time();
+    resume_pending = true;
 
     ESP_LOGI(TAG, "Setting up BLE HID");
 
     ble_hid_config.serial_number = serial_str;
+    s_protocol = protocol;
 
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -375,6 +743,7 @@ void setup(char serial_str[17]) {
     ESP_ERROR_CHECK(
         esp_hidd_dev_init(&ble_hid_config, ESP_HID_TRANSPORT_BLE, ble_hidd_event_callback, &hid_dev)
     );
+    if (bat_pct != BAT_UNKNOWN) esp_hidd_dev_battery_set(hid_dev, bat_pct);
 
     ble_store_config_init();
 
@@ -386,41 +755,178 @@ void setup(char serial_str[17]) {
 }
 
 void end() {
+    Lock lock(dev_mutex);
     if (!active) return;
     active = false;
+    parked = false;
+    {
+        Lock regime_lock(regime_mutex);
+        conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
     esp_hidd_dev_deinit(hid_dev);
     esp_nimble_disable();
     esp_bt_controller_disable();
     esp_bt_controller_deinit();
+
+    mounted = false;
+    host_boot.store(false, std::memory_order_relaxed);
+    boot = false;
+    bat_handle = 0;
+    memset(kbd_report, 0, sizeof(kbd_report));
+    memset(consumer_report, 0, sizeof(consumer_report));
+    for (auto &r : reports) {
+        r.dirty = false;
+    }
     ESP_LOGI(TAG, "BLE HID ended");
 }
 
-void press(const uint8_t key) {
-    if (!mounted) return;
-    for (auto i = 0; i < keycodes_len; i++) {
-        if (keycodes[i] == key) {
-            return;
+// Boot protocol hosts get the classic 6KRO layout built from the bitmap
+static esp_err_t send_boot() {
+    uint8_t report[8] = {kbd_report[0], 0};
+    uint8_t n = 2;
+    for (uint8_t i = 0; i < NKRO_BYTES; i++) {
+        for (uint8_t b = kbd_report[1 + i]; b; b &= b - 1) {
+            if (n == sizeof(report)) {
+                memset(&report[2], 0x01, 6); // ErrorRollOver
+                break;
+            }
+            report[n++] = i * 8 + __builtin_ctz(b);
         }
-        if (keycodes[i] == 0) {
-            keycodes[i] = key;
-            break;
+    }
+    return esp_hidd_dev_input_set(hid_dev, 0, REPORT_ID_KEYBOARD, report, sizeof(report));
+}
+
+// Nothing more goes out once parked, until a replay after resume
+static void flush() {
+    if (!mounted || parked) return;
+    for (auto &r : reports) {
+        if (!r.dirty) continue;
+        r.dirty = false;
+        esp_err_t ret = (boot && r.id == REPORT_ID_KEYBOARD) ?
+            send_boot() :
+            esp_hidd_dev_input_set(hid_dev, 0, r.id, r.data, r.len);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "report %u not sent: %s", r.id, esp_err_to_name(ret));
+        } else if (resume_pending) {
+            resume_pending = false;
+            ESP_LOGI(TAG, "first report %lld ms after resume", (esp_timer_get_time() - resume_us) / 1000);
         }
     }
-    uint8_t report[7] = {modifiers, 0};
-    memcpy(&report[2], keycodes, 5);
-    ESP_ERROR_CHECK(esp_hidd_dev_input_set(hid_dev, 0, 1, report, sizeof(report)));
 }
 
-void release(const uint8_t key) {
-    if (!mounted) return;
-    for (auto i = 0; i < keycodes_len; i++) {
-        if (keycodes[i] == key) {
-            keycodes[i] = 0;
+void park() {
+#if CONFIG_KEYBOARD_BLE_STANDBY_COLD
+    end();
+#else
+    Lock lock(dev_mutex);
+    if (!active || parked) return;
+
+    // Leave the host with nothing held before going quiet
+    resume_pending = false;
+    memset(kbd_report, 0, sizeof(kbd_report));
+    memset(consumer_report, 0, sizeof(consumer_report));
+    for (auto &r : reports) {
+        r.dirty = true;
+    }
+    flush();
+
+    parked = true;
+    ble_gap_adv_stop();
+#if CONFIG_KEYBOARD_BLE_STANDBY_WARM
+    if (conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+#else
+    {
+        Lock lock(regime_mutex);
+        request_regime(Regime::IDLE);
+    }
+#endif
+    ESP_LOGI(TAG, "BLE HID parked");
+#endif
+}
+
+bool ready() {
+    return mounted && !parked;
+}
+
+void idle() {
+    want_regime(Regime::IDLE);
+}
+
+// One report per connection event; before the first connection, assume the slowest active interval
+uint32_t frameUs() {
+    return (s_stats.itvl ? s_stats.itvl : CONFIG_KEYBOARD_BLE_ACTIVE_ITVL_MAX) * 1250;
+}
+
+// The service only notifies when the level itself moves. The level has no room for the
+// charging state, so a plug change that leaves it alone is pushed by hand.
+void battery(uint8_t pct, bool charging) {
+    Lock lock(dev_mutex);
+    const bool level = pct != bat_pct;
+    const bool plug = charging != bat_charging;
+    bat_pct = pct;
+    bat_charging = charging;
+    if (!active) return;
+
+    if (level) {
+        esp_hidd_dev_battery_set(hid_dev, pct);
+    } else if (plug && mounted) {
+        if (!bat_handle) {
+            ble_gatts_find_chr(&bas_svc_uuid.u, &bas_level_uuid.u, nullptr, &bat_handle);
         }
+        if (bat_handle) ble_gatts_chr_updated(bat_handle);
+    }
+}
+
+const Stats &stats() {
+    return s_stats;
+}
+
+static void update(const KeyState &keys) {
+    want_regime(Regime::ACTIVE);
+
+    // Only the bytes that moved are written
+    bool changed = false;
+    auto patch = [&](uint8_t i, uint8_t v) {
+        if (kbd_report[i] == v) return;
+        kbd_report[i] = v;
+        changed = true;
+    };
+    patch(0, keys.modifiers);
+    for (uint8_t i = 0; i < NKRO_BYTES; i++) {
+        patch(1 + i, keys.bits[i] & ~ConsumerMask.bits[i]);
+    }
+    if (changed) reports[0].dirty = true;
+
+    uint16_t usage = 0;
+    for (const auto &c : ConsumerKeys) {
+        if (keys.held(c.key)) {
+            usage = c.usage;
+            break;
+        }
+    }
+    if ((consumer_report[0] | (consumer_report[1] << 8)) != usage) {
+        consumer_report[0] = usage & 0xFF;
+        consumer_report[1] = usage >> 8;
+        reports[1].dirty = true;
+    }
+
+    flush();
+}
+
+void send(const KeyState &keys) {
+    Lock lock(dev_mutex);
+    update(keys);
+}
+
+void replay(const KeyState &keys) {
+    Lock lock(dev_mutex);
+    boot = host_boot.load(std::memory_order_acquire);
+    for (auto &r : reports) {
+        r.dirty = true;
     }
-    uint8_t report[7] = {modifiers, 0};
-    memcpy(&report[2], keycodes, 5);
-    ESP_ERROR_CHECK(esp_hidd_dev_input_set(hid_dev, 0, 1, report, sizeof(report)));
+    update(keys);
 }
 
 }
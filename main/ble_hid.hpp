@@ -1,10 +1,33 @@
 #pragma once
 
 #include <cstdint>
+#include "key_state.hpp"
 
 namespace ble_hid {
-    void setup(char serial_str[17]);
+    enum class Regime : uint8_t {
+        ACTIVE,
+        IDLE,
+    };
+
+    struct Stats {
+        uint16_t itvl;      // negotiated interval, 1.25 ms units
+        uint16_t latency;   // negotiated slave latency, events
+        uint16_t timeout;   // negotiated supervision timeout, 10 ms units
+        uint64_t regimeUs[2];
+        uint32_t reconnectMs; // advertising start to encrypted link, last reconnect
+    };
+
+    // protocol() runs on the esp_event task when the host switches between boot and report protocol
+    void setup(char serial_str[17], void (*protocol)());
     void end();
-    void press(const uint8_t key);
-    void release(const uint8_t key);
+    void park();
+    bool ready();
+    void send(const KeyState &keys);
+    void replay(const KeyState &keys);
+    // Shortest spacing between reports the link delivers
+    uint32_t frameUs();
+    void idle();
+    // Battery Service level; the host only hears about it when something changed
+    void battery(uint8_t pct, bool charging);
+    const Stats &stats();
 }
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+// Metronome click sounds. The buzzer plays a PWM square wave at the sound's pitch and its
+// loudness follows the duty cycle, which the LEDC fade engine ramps through the envelope
+// one segment at a time. Pure C++ so the host renderer plays back the same tables.
+namespace click {
+    // 10-bit duty; a square wave is loudest at 50%
+    constexpr uint16_t DUTY_MAX = 512;
+    constexpr uint8_t MAX_SEGMENTS = 6;
+
+    struct Segment {
+        uint16_t duty;  // ramp target
+        uint16_t ms;    // ramp length
+    };
+
+    struct Sound {
+        uint16_t hz;
+        uint8_t len;
+        Segment seg[MAX_SEGMENTS];
+    };
+
+    // Fast linear attack, then an exponential decay as ramps that each halve the level
+    constexpr Sound envelope(uint16_t hz, uint16_t peak, uint16_t attack_ms, uint16_t half_ms) {
+        Sound s = { hz, 0, {} };
+        s.seg[s.len++] = { peak, attack_ms };
+        while (s.len < MAX_SEGMENTS - 1) {
+            peak /= 2;
+            s.seg[s.len++] = { peak, half_ms };
+        }
+        s.seg[s.len++] = { 0, half_ms };
+        return s;
+    }
+
+    constexpr Sound ACCENT = envelope(2400, DUTY_MAX, 1, 12);
+    constexpr Sound BEAT = envelope(1800, DUTY_MAX * 3 / 4, 1, 8);
+    constexpr Sound SUB = envelope(1200, DUTY_MAX / 3, 1, 4);
+
+    constexpr uint32_t lengthUs(const Sound &s) {
+        uint32_t us = 0;
+        for (uint8_t i = 0; i < s.len; i++) us += s.seg[i].ms * 1000;
+        return us;
+    }
+
+    // Duty t us into the sound, ramping linearly from where the previous segment ended
+    constexpr uint16_t dutyAt(const Sound &s, uint32_t us) {
+        uint16_t from = 0;
+        for (uint8_t i = 0; i < s.len; i++) {
+            const uint32_t len = s.seg[i].ms * 1000;
+            if (us < len) return from + ((int32_t)s.seg[i].duty - from) * (int32_t)us / (int32_t)len;
+            us -= len;
+            from = s.seg[i].duty;
+        }
+        return 0;
+    }
+}
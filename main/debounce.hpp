@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+
+// Per-key debounce algorithms, stepped once per matrix scan.
+// Pure C++ so the host simulator runs the exact code the scanner does.
+namespace debounce {
+    enum class Algo : uint8_t {
+        DEFERRED,       // either edge once the new level held for a whole window
+        EAGER,          // either edge on first sight, then ignore the switch for a window
+        EAGER_PRESS,    // press on first sight, release once open for a whole window
+    };
+
+    struct Key {
+        bool state;     // debounced
+        uint8_t timer;  // scans into / left on the current window
+    };
+
+    // Each returns whether the debounced state flipped
+    inline bool deferred(Key &k, const bool raw, const uint8_t window) {
+        if (raw == k.state) {
+            k.timer = 0;
+            return false;
+        }
+        if (++k.timer < window) return false;
+        k.state = raw;
+        k.timer = 0;
+        return true;
+    }
+
+    inline bool eager(Key &k, const bool raw, const uint8_t window) {
+        if (k.timer) {
+            k.timer--;
+            return false;
+        }
+        if (raw == k.state) return false;
+        k.state = raw;
+        k.timer = window;
+        return true;
+    }
+
+    inline bool eagerPress(Key &k, const bool raw, const uint8_t window) {
+        if (!k.state) {
+            if (!raw) return false;
+            k.state = true;
+            k.timer = window;
+            return true;
+        }
+        // Contact while held restarts the window, which also swallows press bounce
+        if (raw) {
+            k.timer = window;
+            return false;
+        }
+        if (k.timer && --k.timer) return false;
+        k.state = false;
+        return true;
+    }
+
+    inline bool update(const Algo algo, Key &k, const bool raw, const uint8_t window) {
+        switch (algo) {
+            case Algo::DEFERRED: return deferred(k, raw, window);
+            case Algo::EAGER: return eager(k, raw, window);
+            case Algo::EAGER_PRESS: return eagerPress(k, raw, window);
+        }
+        return false;
+    }
+
+    // Nothing pending: the key is up and no window is running
+    inline bool settled(const Key &k) {
+        return !k.state && !k.timer;
+    }
+
+    constexpr const char *name(const Algo algo) {
+        return algo == Algo::DEFERRED ? "deferred" :
+               algo == Algo::EAGER ? "eager" :
+               "eager-press";
+    }
+}
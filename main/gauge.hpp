@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+
+// Battery state of charge from the cell voltage. Pure C++ so host/battery_replay runs the
+// same estimator on recorded traces.
+namespace gauge {
+    struct CurveNode {
+        uint16_t mV;
+        uint8_t pct;
+    };
+
+    constexpr uint8_t CURVE_LEN = 13;
+
+    constexpr CurveNode Chrg[CURVE_LEN] {
+        {3000, 0},  {3200, 5},  {3350,10}, {3450,15}, {3550,20},
+        {3630,30},  {3700,40},  {3770,50}, {3820,60}, {3870,70},
+        {3920,80},  {4050,90},  {4200,100}
+    };
+
+    constexpr CurveNode DisChrg[CURVE_LEN] {
+        {3000, 0},  {3230, 5},  {3380,10}, {3480,15}, {3600,20},
+        {3680,30},  {3750,40},  {3820,50}, {3860,60}, {3910,70},
+        {3960,80},  {4080,90},  {4200,100}
+    };
+
+    // Filter time constant for the cell voltage
+    constexpr int64_t TAU_US = 60 * 1000 * 1000;
+    // CHRG has to hold a new level this long before the other curve is used
+    constexpr int64_t HOLD_US = 10 * 1000 * 1000;
+    // After the LED rail switches, the cell takes a while to recover or sag fully
+    constexpr int64_t SETTLE_US = 3 * 1000 * 1000;
+    // Drop the LED rail puts on the cell, added back while it is powered
+    constexpr uint16_t LED_SAG_MV = 40;
+    // A reading further than this from the estimate only pulls it this far
+    constexpr uint16_t CLAMP_MV = 60;
+    // The reported percentage moves once the estimate is this far past the half-way point
+    constexpr uint16_t DEADBAND_Q8 = 64;
+
+    // Mean without the lowest and the highest sample
+    struct Trim {
+        uint32_t sum = 0;
+        uint32_t n = 0;
+        uint16_t lo = UINT16_MAX;
+        uint16_t hi = 0;
+
+        constexpr void add(uint16_t v) {
+            sum += v;
+            n++;
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+        }
+
+        constexpr uint16_t mean() const {
+            if (n < 3) return n ? sum / n : 0;
+            return (sum - lo - hi) / (n - 2);
+        }
+    };
+
+    constexpr uint16_t percentQ8(uint16_t mV, const CurveNode *curve) {
+        if (mV <= curve[0].mV) return curve[0].pct << 8;
+        if (mV >= curve[CURVE_LEN - 1].mV) return curve[CURVE_LEN - 1].pct << 8;
+
+        uint8_t lo = 0, hi = CURVE_LEN - 1;
+        while (hi - lo > 1) {
+            auto mid = (lo + hi) >> 1;
+            if (mV < curve[mid].mV) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
+        }
+        const auto &L = curve[lo];
+        const auto &H = curve[hi];
+        const uint32_t span_pct_q8 = (uint32_t)(H.pct - L.pct) << 8;
+        return (L.pct << 8) + span_pct_q8 * (mV - L.mV) / (H.mV - L.mV);
+    }
+
+    struct Sample {
+        int64_t us;
+        uint16_t mV;     // at the pin, after the divider is scaled out
+        bool charging;   // CHRG as read
+        bool loaded;     // LED rail powered
+    };
+
+    struct State {
+        bool inited;
+        bool charging;      // curve in use
+        bool loaded;
+        int64_t us;
+        int64_t pinSince;   // when CHRG started disagreeing with `charging`, or -1
+        int64_t loadSince;  // last LED rail switch
+        uint32_t mV_q8;     // filtered, sag compensated
+        uint8_t pct;        // reported
+    };
+
+    constexpr uint16_t mV(const State &s) {
+        return (s.mV_q8 + 128) >> 8;
+    }
+
+    constexpr uint16_t estimateQ8(const State &s) {
+        return percentQ8(mV(s), s.charging ? Chrg : DisChrg);
+    }
+
+    constexpr uint8_t report(const State &s) {
+        const int32_t est = estimateQ8(s);
+        const int32_t off = est - (s.pct << 8);
+        if (off > 128 + DEADBAND_Q8 || off < -(128 + DEADBAND_Q8)) return (est + 128) >> 8;
+        return s.pct;
+    }
+
+    // Folds one reading into the estimate
+    constexpr State step(State s, const Sample &x) {
+        const uint16_t mV = x.mV + (x.loaded ? LED_SAG_MV : 0);
+        if (!s.inited) {
+            s = { true, x.charging, x.loaded, x.us, -1, x.us - SETTLE_US, (uint32_t)mV << 8, 0 };
+            s.pct = (estimateQ8(s) + 128) >> 8;
+            return s;
+        }
+
+        const int64_t dt = x.us - s.us;
+        s.us = x.us;
+        if (x.loaded != s.loaded) {
+            s.loaded = x.loaded;
+            s.loadSince = x.us;
+        }
+
+        // Readings while CHRG is in doubt belong to neither curve, so they are skipped. Once
+        // it holds, the charger current has moved the cell voltage for real and the estimate
+        // starts over from the reading.
+        if (x.charging != s.charging) {
+            if (s.pinSince < 0) s.pinSince = x.us;
+            if (x.us - s.pinSince < HOLD_US) return s;
+            s.charging = x.charging;
+            s.pinSince = -1;
+            s.mV_q8 = (uint32_t)mV << 8;
+            s.pct = report(s);
+            return s;
+        }
+        s.pinSince = -1;
+        if (x.us - s.loadSince < SETTLE_US || dt <= 0) return s;
+
+        int32_t d = ((int32_t)mV << 8) - (int32_t)s.mV_q8;
+        if (d > (CLAMP_MV << 8)) d = CLAMP_MV << 8;
+        if (d < -(CLAMP_MV << 8)) d = -(CLAMP_MV << 8);
+        const int64_t w = dt < TAU_US ? dt : TAU_US;
+        s.mV_q8 += (int32_t)(d * w / (TAU_US + w));
+        s.pct = report(s);
+        return s;
+    }
+}
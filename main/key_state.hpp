@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+// Keys currently held, independent of the transport that reports them.
+// Modifiers (0xE0..0xE7) live in their own byte, everything else is one bit per usage.
+struct KeyState {
+    uint8_t modifiers = 0;
+    uint8_t bits[32] = {0};
+
+    static constexpr bool isModifier(const uint8_t key) {
+        return key >= 0xE0 && key <= 0xE7;
+    }
+
+    bool held(const uint8_t key) const {
+        if (isModifier(key)) return modifiers & (1 << (key - 0xE0));
+        return bits[key >> 3] & (1 << (key & 7));
+    }
+
+    // Both return whether the state changed
+    bool press(const uint8_t key) {
+        if (!key || held(key)) return false;
+        if (isModifier(key)) {
+            modifiers |= 1 << (key - 0xE0);
+        } else {
+            bits[key >> 3] |= 1 << (key & 7);
+        }
+        return true;
+    }
+
+    bool release(const uint8_t key) {
+        if (!held(key)) return false;
+        if (isModifier(key)) {
+            modifiers &= ~(1 << (key - 0xE0));
+        } else {
+            bits[key >> 3] &= ~(1 << (key & 7));
+        }
+        return true;
+    }
+};
@@ -2,82 +2,405 @@
 #include "led.hpp"
 #include "usb_hid.hpp"
 #include "ble_hid.hpp"
+#include "key_state.hpp"
+#include "keymap.hpp"
+#include "macro.hpp"
+#include "mode.hpp"
+#include "metronome.hpp"
+#include "spsc_ring.hpp"
+#include "matrix.hpp"
+#include "layout.hpp"
+#include "power.hpp"
 
 extern "C" {
-    #include <keyboard_button.h>
+    #include <sdkconfig.h>
     #include <driver/usb_serial_jtag.h>
     #include <esp_mac.h>
+    #include <esp_timer.h>
+    #include <esp_sleep.h>
+    #include <hal/gpio_ll.h>
+    #include <soc/gpio_struct.h>
     #include <esp_log.h>
 }
 
-constexpr TickType_t SLEEP_TICKS = pdMS_TO_TICKS(5 * 60 * 1000);
+#include <algorithm>
+#include <atomic>
+
+static const char *TAG = "KEYBOARD";
+
+// Idle on battery: LEDs off, then the link parked and light sleep, then deep sleep
+constexpr TickType_t DARK_TICKS = pdMS_TO_TICKS(CONFIG_KEYBOARD_IDLE_DARK_S * 1000);
+constexpr TickType_t SLEEP_TICKS = pdMS_TO_TICKS(CONFIG_KEYBOARD_IDLE_SLEEP_S * 1000);
+constexpr int64_t DEEP_SLEEP_US = CONFIG_KEYBOARD_IDLE_DEEP_S * 1000000LL;
+// After a wake, key events wait this long for the link before they count as lost
+constexpr int64_t WAKE_LATCH_US = 10 * 1000 * 1000;
+constexpr TickType_t BLE_IDLE_TICKS = pdMS_TO_TICKS(CONFIG_KEYBOARD_BLE_IDLE_MS);
 TickType_t gLastTick = 0;
 
-static keyboard_btn_handle_t s_kbd = nullptr;
+using keymap::TRNS;
+using keymap::LT;
+using keymap::TG;
 
-constexpr int ROWS[] = {9, 10, 12, 13};
-constexpr int ROWS_LEN = sizeof(ROWS) / sizeof(ROWS[0]);
-constexpr int COLS[] = {3, 11, 14, 21};
-constexpr int COLS_LEN = sizeof(COLS) / sizeof(COLS[0]);
+// Hold the top right key for navigation and media; TG(2) there locks the F keys
+constexpr keymap::Action Layers[][ROWS_LEN][COLS_LEN] = {
+    {
+        { HID_KEY_KEYPAD_7, HID_KEY_KEYPAD_8,       HID_KEY_KEYPAD_9, LT(1, HID_KEY_MUTE), },
+        { HID_KEY_KEYPAD_4, HID_KEY_KEYPAD_5,       HID_KEY_KEYPAD_6, HID_KEY_KEYPAD_ADD, },
+        { HID_KEY_KEYPAD_1, HID_KEY_KEYPAD_2,       HID_KEY_KEYPAD_3, HID_KEY_KEYPAD_SUBTRACT, },
+        { HID_KEY_KEYPAD_0, HID_KEY_KEYPAD_DECIMAL, HID_KEY_TAB,      HID_KEY_ENTER, },
+    },
+    {
+        { HID_KEY_HOME,       HID_KEY_ARROW_UP,   HID_KEY_PAGE_UP,     TRNS, },
+        { HID_KEY_ARROW_LEFT, HID_KEY_ESCAPE,     HID_KEY_ARROW_RIGHT, HID_KEY_VOLUME_UP, },
+        { HID_KEY_END,        HID_KEY_ARROW_DOWN, HID_KEY_PAGE_DOWN,   HID_KEY_VOLUME_DOWN, },
+        { HID_KEY_INSERT,     HID_KEY_DELETE,     TG(2),               HID_KEY_BACKSPACE, },
+    },
+    {
+        { HID_KEY_F7,  HID_KEY_F8,  HID_KEY_F9, TRNS, },
+        { HID_KEY_F4,  HID_KEY_F5,  HID_KEY_F6, HID_KEY_F11, },
+        { HID_KEY_F1,  HID_KEY_F2,  HID_KEY_F3, HID_KEY_F12, },
+        { HID_KEY_F10, TRNS,        TG(2),      TRNS, },
+    },
+};
+constexpr size_t LAYERS = sizeof(Layers) / sizeof(Layers[0]);
+constexpr size_t KEYS = ROWS_LEN * COLS_LEN;
+constexpr auto Resolved = keymap::flatten(Layers);
 
-constexpr uint8_t KeyMap[ROWS_LEN][COLS_LEN] = {
-    { HID_KEY_KEYPAD_7, HID_KEY_KEYPAD_8,       HID_KEY_KEYPAD_9, HID_KEY_MUTE, },
-    { HID_KEY_KEYPAD_4, HID_KEY_KEYPAD_5,       HID_KEY_KEYPAD_6, HID_KEY_KEYPAD_ADD, },
-    { HID_KEY_KEYPAD_1, HID_KEY_KEYPAD_2,       HID_KEY_KEYPAD_3, HID_KEY_KEYPAD_SUBTRACT, },
-    { HID_KEY_KEYPAD_0, HID_KEY_KEYPAD_DECIMAL, HID_KEY_TAB,      HID_KEY_ENTER, },
+// BootMode::MACRO: keys with a macro play it, the rest type as usual
+static const uint8_t MacroHello[] = {
+    macro::TEXT, 13, 'H', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l', 'd', '!',
+    macro::TAP, HID_KEY_ENTER,
+    macro::END,
+};
+static const uint8_t MacroCopy[] = {
+    macro::PRESS, HID_KEY_CONTROL_LEFT, macro::TAP, HID_KEY_C, macro::RELEASE, HID_KEY_CONTROL_LEFT,
+    macro::END,
+};
+static const uint8_t MacroPaste[] = {
+    macro::PRESS, HID_KEY_CONTROL_LEFT, macro::TAP, HID_KEY_V, macro::RELEASE, HID_KEY_CONTROL_LEFT,
+    macro::END,
+};
+// Windows Run dialog, give it time to open, then Notepad
+static const uint8_t MacroNotepad[] = {
+    macro::PRESS, HID_KEY_GUI_LEFT, macro::TAP, HID_KEY_R, macro::RELEASE, HID_KEY_GUI_LEFT,
+    MACRO_DELAY(400),
+    macro::TEXT, 7, 'n', 'o', 't', 'e', 'p', 'a', 'd',
+    macro::TAP, HID_KEY_ENTER,
+    macro::END,
+};
+static const uint8_t *const Macros[ROWS_LEN][COLS_LEN] = {
+    { MacroHello, MacroCopy, MacroPaste, nullptr, },
+    { MacroNotepad, nullptr, nullptr, nullptr, },
+    { nullptr, nullptr, nullptr, nullptr, },
+    { nullptr, nullptr, nullptr, nullptr, },
 };
 
+constexpr int64_t TAPPING_TERM_US = CONFIG_KEYBOARD_TAPPING_TERM_MS * 1000;
+#ifdef CONFIG_KEYBOARD_PERMISSIVE_HOLD
+constexpr bool PERMISSIVE_HOLD = true;
+#else
+constexpr bool PERMISSIVE_HOLD = false;
+#endif
+
 #define VBUS_MONITOR_IO GPIO_NUM_1
+constexpr TickType_t VBUS_DEBOUNCE_TICKS = pdMS_TO_TICKS(30);
 
 static char serial_str[17];
 
+struct Transport {
+    const char *name;
+    bool (*ready)();
+    void (*send)(const KeyState &keys);
+    void (*replay)(const KeyState &keys);
+    uint32_t (*frameUs)();
+};
+
+static const Transport USB = { "USB", usb_hid::ready, usb_hid::send, usb_hid::replay, usb_hid::frameUs };
+static const Transport BLE = { "BLE", ble_hid::ready, ble_hid::send, ble_hid::replay, ble_hid::frameUs };
+
+// Set by LinkTask once a transport is up, cleared from the VBUS ISR the moment the cable moves
+static std::atomic<const Transport*> s_link{nullptr};
+static TaskHandle_t s_link_task = nullptr;
+// Held while USB is the transport; the controller stops on a lowered APB clock
+static esp_pm_lock_handle_t s_usb_pm = nullptr;
+
+// Scan callback -> HidTask. The scan never waits on TinyUSB or NimBLE.
+struct KeyEvent {
+    int64_t us;
+    uint8_t row;
+    uint8_t col;
+    bool pressed;
+};
+
+constexpr uint32_t EVENT_RING = 64;
+static SpscRing<KeyEvent, EVENT_RING> s_events;
+// Releases the ring had no room for, a bit per key; HidTask applies them so no key sticks
+static std::atomic<uint32_t> s_dropped_releases{0};
+static_assert(KEYS <= 32, "s_dropped_releases has a bit per key");
+static TaskHandle_t s_hid_task = nullptr;
+
+// HidTask notification bits
+constexpr uint32_t HID_EVENTS = 1 << 0;
+constexpr uint32_t HID_REPLAY = 1 << 1;
+constexpr uint32_t HID_MACRO = 1 << 2;
+
+// Held keys outlive the transport; owned by HidTask, replayed after a switch
+static KeyState s_keys;
+// Key events that reached no host because no transport was up
+static uint32_t s_lost = 0;
+// Worst scan-to-send time seen by HidTask
+static uint32_t s_max_latency_us = 0;
+// When the board last woke from sleep, until HidTask has sent what woke it; 0 otherwise
+static std::atomic<int64_t> s_wake_us{0};
+// LEDs switched off by the idle stages; the next key has LinkTask restore them
+static std::atomic<bool> s_dark{false};
+
+static void flush(const KeyState &keys) {
+    auto link = s_link.load(std::memory_order_acquire);
+    if (link && link->ready()) link->send(keys);
+}
+
+static keymap::Engine<LAYERS, KEYS> s_keymap(Resolved, TAPPING_TERM_US, PERMISSIVE_HOLD, flush);
+
 void inline tick() {
     gLastTick = xTaskGetTickCount();
+    if (s_dark.load(std::memory_order_relaxed)) xTaskNotifyGive(s_link_task);
 }
 
 bool inline isUsb() {
     return gpio_get_level(VBUS_MONITOR_IO);
 }
 
-void press(const uint8_t key) {
-    isUsb() ?
-        usb_hid::press(key) :
-        ble_hid::press(key);
+static void IRAM_ATTR vbus_isr(void*) {
+    BaseType_t woken = pdFALSE;
+    // Back to edges if this was the battery-side wake level, or it would fire until USB is up
+    gpio_ll_set_intr_type(&GPIO, VBUS_MONITOR_IO, GPIO_INTR_ANYEDGE);
+    s_link.store(nullptr, std::memory_order_release);
+    vTaskNotifyGiveFromISR(s_link_task, &woken);
+    portYIELD_FROM_ISR(woken);
 }
 
-void release(const uint8_t key) {
-    isUsb() ?
-        usb_hid::release(key) :
-        ble_hid::release(key);
+// Light sleep only wakes on a level, so on battery VBUS waits for high and the ISR switches it
+// back to edges when it fires. Re-armed on every LinkTask pass in case the plug bounced.
+static void arm_vbus(bool usb) {
+    if (usb) {
+        gpio_wakeup_disable(VBUS_MONITOR_IO);
+        gpio_set_intr_type(VBUS_MONITOR_IO, GPIO_INTR_ANYEDGE);
+    } else {
+        ESP_ERROR_CHECK(gpio_wakeup_enable(VBUS_MONITOR_IO, GPIO_INTR_HIGH_LEVEL));
+    }
 }
 
-static void keyboard_cb(keyboard_btn_handle_t kbd_handle, keyboard_btn_report_t kbd_report, void *user_data) {
-    for (auto i = 0; i < kbd_report.key_pressed_num; i++) {
-        auto d = kbd_report.key_data[i];
-        uint8_t key = KeyMap[d.output_index][d.input_index];
-        press(key);
-        tick();
+static void macro_wake() {
+    xTaskNotify(s_hid_task, HID_MACRO, eSetBits);
+}
+
+// Either host switching between boot and report protocol; HidTask resends the held keys
+static void protocol_changed() {
+    xTaskNotify(s_hid_task, HID_REPLAY, eSetBits);
+}
+
+// A macro key starts playback, or stops it when pressed again; returns whether keys changed
+static bool macro_key(uint8_t row, uint8_t col) {
+    const uint8_t pos = row * COLS_LEN + col;
+    if (macro::running()) {
+        if (macro::owner() == pos) return macro::abort(s_keys);
+        return false;
+    }
+    auto link = s_link.load(std::memory_order_acquire);
+    if (!link || !link->ready()) return false;
+    macro::start(Macros[row][col], pos, link->frameUs());
+    return false;
+}
+
+static void keyboard_cb(const matrix::Event *events, uint8_t count) {
+    const int64_t now = esp_timer_get_time();
+    for (auto i = 0; i < count; i++) {
+        const auto &ev = events[i];
+        if (!s_events.push({ now, ev.row, ev.col, ev.pressed }) && !ev.pressed) {
+            s_dropped_releases.fetch_or(1u << (ev.row * COLS_LEN + ev.col), std::memory_order_release);
+        }
+        ledKey(events[i].row, events[i].col, events[i].pressed, now);
+    }
+    xTaskNotify(s_hid_task, HID_EVENTS, eSetBits);
+    tick();
+}
+
+void HidTask(void*) {
+    for (;;) {
+        // Wake up for an undecided tap-hold key once its tapping term runs out, and for the
+        // events held after a wake once the latch does
+        TickType_t wait = portMAX_DELAY;
+        int64_t deadline = s_keymap.deadline();
+        if (const int64_t latched = s_wake_us.load(std::memory_order_acquire)) {
+            if (!deadline || latched + WAKE_LATCH_US < deadline) deadline = latched + WAKE_LATCH_US;
+        }
+        if (deadline) {
+            int64_t left = deadline - esp_timer_get_time();
+            wait = left > 0 ? pdMS_TO_TICKS((left + 999) / 1000) : 0;
+        }
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+        auto link = s_link.load(std::memory_order_acquire);
+        const bool ready = link && link->ready();
+
+        // The keys that woke the board stay queued until the link is back, then go out one
+        // event at a time so a tap that came and went in the meantime still registers. Past
+        // half a ring they go through as lost, so typing on can't overflow it.
+        const int64_t woke = s_wake_us.load(std::memory_order_acquire);
+        if (woke && !ready && esp_timer_get_time() - woke < WAKE_LATCH_US &&
+            s_events.depth() < EVENT_RING / 2) continue;
+        const bool catchup = woke && ready;
+
+        // Drain everything queued so a roll or chord leaves as a single report
+        KeyEvent e;
+        int64_t oldest = 0;
+        uint32_t count = 0;
+        // Events held back behind a tap-hold key would count their wait as latency
+        const bool held_back = s_keymap.deadline();
+        bool changed = s_keymap.expire(esp_timer_get_time(), s_keys);
+        if (bits & HID_MACRO) {
+            changed |= macro::step(s_keys);
+            if (macro::running()) tick();
+        }
+        while (s_events.pop(e)) {
+            if (!count++) oldest = e.us;
+            if (gBootMode == BootMode::METRONOME) {
+                // The pad drives the metronome; keys keep their base layer meaning
+                if (e.pressed) metronome::key(keymap::tapOf(Resolved[0][e.row * COLS_LEN + e.col]), e.us);
+                continue;
+            }
+            if (gBootMode == BootMode::MACRO && Macros[e.row][e.col]) {
+                if (e.pressed) changed |= macro_key(e.row, e.col);
+                continue;
+            }
+            const bool c = s_keymap.process({ e.us, (uint8_t)(e.row * COLS_LEN + e.col), e.pressed }, s_keys);
+            if (catchup && c) link->send(s_keys);
+            changed |= c;
+        }
+        // A release of a key the keymap doesn't hold is a no-op
+        for (uint32_t dropped = s_dropped_releases.exchange(0, std::memory_order_acquire); dropped; dropped &= dropped - 1) {
+            changed |= s_keymap.process({ esp_timer_get_time(), (uint8_t)__builtin_ctz(dropped), false }, s_keys);
+        }
+        if (catchup && count) {
+            s_wake_us.store(0, std::memory_order_release);
+            ESP_LOGI(
+                TAG, "first report %lld ms after wake, %" PRIu32 " event(s) held for the link",
+                (esp_timer_get_time() - woke) / 1000, count
+            );
+        } else if (woke && esp_timer_get_time() - woke >= WAKE_LATCH_US) {
+            s_wake_us.store(0, std::memory_order_release);
+        }
+
+        if (ready && (bits & HID_REPLAY)) {
+            link->replay(s_keys);
+            ESP_LOGI(
+                TAG, "%s ready; lost=%" PRIu32 " overflow=%" PRIu32 " hwm=%" PRIu32 " max latency=%" PRIu32 " us",
+                link->name, s_lost, s_events.overflows(), s_events.depthHighWater(), s_max_latency_us
+            );
+        } else if (changed && ready) {
+            link->send(s_keys);
+            if (count && !held_back && !catchup) {
+                uint32_t latency = esp_timer_get_time() - oldest;
+                if (latency > s_max_latency_us) s_max_latency_us = latency;
+            }
+        } else if (changed) {
+            s_lost += count;
+        }
     }
-    for (auto i = 0; i < kbd_report.key_release_num; i++) {
-        auto d = kbd_report.key_release_data[i];
-        uint8_t key = KeyMap[d.output_index][d.input_index];
-        release(key);
-        tick();
+}
+
+// Light sleep until a key or VBUS wakes the board, and after DEEP_SLEEP_US more of nothing, deep
+// sleep. A held key would wake it straight back up, so there is no sleep until it is let go.
+static bool idle_sleep() {
+    if (!matrix::parked()) return false;
+    // HidTask stops routing here first; LinkTask points it back at the link after the wake
+    s_link.store(nullptr, std::memory_order_release);
+    ble_hid::park();
+    if (DEEP_SLEEP_US) esp_sleep_enable_timer_wakeup(DEEP_SLEEP_US);
+    ESP_LOGI(TAG, "idle; light sleep");
+
+    const int64_t slept = esp_timer_get_time();
+    esp_light_sleep_start();
+    const int64_t now = esp_timer_get_time();
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+        ESP_LOGI(TAG, "idle %lld s in light sleep; deep sleep", (now - slept) / 1000000);
+        esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+        matrix::armDeepWake(1ULL << VBUS_MONITOR_IO);
+        esp_deep_sleep_start();
     }
+
+    s_wake_us.store(now, std::memory_order_release);
+    tick();
+    ESP_LOGI(TAG, "woke after %lld s in light sleep", (now - slept) / 1000000);
+    if (!isUsb()) ble_hid::setup(serial_str, protocol_changed);
+    return true;
 }
 
 void LinkTask(void*) {
-    const TickType_t interval = pdMS_TO_TICKS(500);
-    TickType_t last = xTaskGetTickCount();
+    const Transport *current = nullptr;
+    bool wasReady = false;
     for (;;) {
-        if (isUsb()) {
-            ble_hid::end();
-            usb_hid::setup(serial_str);
+        const bool usb = isUsb();
+        const Transport *want = usb ? &USB : &BLE;
+        arm_vbus(usb);
+        if (want != current) {
+            if (usb) {
+                power::acquire(s_usb_pm);
+                ble_hid::park();
+                usb_hid::setup(serial_str, protocol_changed);
+            } else {
+                ble_hid::setup(serial_str, protocol_changed);
+                usb_hid::end();
+                if (current) power::release(s_usb_pm);
+            }
+            current = want;
+            wasReady = false;
+        }
+
+        // Route to the transport, and have HidTask hand it the held keys once its host is listening
+        const bool ready = current->ready();
+        const bool rerouted = s_link.exchange(current, std::memory_order_acq_rel) != current;
+        if (ready && (!wasReady || rerouted)) {
+            xTaskNotify(s_hid_task, HID_REPLAY, eSetBits);
+        }
+        wasReady = ready;
+        // Sleep until VBUS moves; poll only while waiting for the host to enumerate or connect,
+        // and on BLE wake up once more when typing stops to relax the connection
+        TickType_t wait = ready ? portMAX_DELAY : pdMS_TO_TICKS(50);
+        if (ready && current == &BLE) {
+            TickType_t since = xTaskGetTickCount() - gLastTick;
+            if (since >= BLE_IDLE_TICKS) {
+                ble_hid::idle();
+                wait = BLE_IDLE_TICKS;
+            } else {
+                wait = BLE_IDLE_TICKS - since;
+            }
+        }
+
+        // On battery, idling steps down through dark LEDs to sleep; a key or USB brings it back
+        const TickType_t idle = xTaskGetTickCount() - gLastTick;
+        if (usb || idle < DARK_TICKS || metronome::phase(esp_timer_get_time()).running) {
+            if (s_dark.exchange(false)) restoreLED();
+            if (!usb) wait = std::min(wait, idle < DARK_TICKS ? DARK_TICKS - idle : DARK_TICKS);
         } else {
-            ble_hid::setup(serial_str);
-            usb_hid::end();
+            if (!s_dark.exchange(true)) fillDark();
+            if (idle < SLEEP_TICKS) {
+                wait = std::min(wait, SLEEP_TICKS - idle);
+            } else if (idle_sleep()) {
+                continue;
+            } else {
+                wait = std::min(wait, pdMS_TO_TICKS(1000));
+            }
+        }
+
+        // A key while dark lands here too
+        if (ulTaskNotifyTake(pdTRUE, wait)) {
+            // Let the level settle; every further edge restarts the wait
+            while (ulTaskNotifyTake(pdTRUE, VBUS_DEBOUNCE_TICKS));
         }
-        vTaskDelayUntil(&last, interval);
     }
 }
 
@@ -88,7 +411,7 @@ void setupKeyboard() {
         .mode = GPIO_MODE_INPUT,
         .pull_up_en = GPIO_PULLUP_DISABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
     };
     gpio_config(&io);
 
@@ -102,23 +425,34 @@ void setupKeyboard() {
         (uint32_t)mac
     );
 
-    keyboard_btn_config_t cfg = {
-        .output_gpios = ROWS,
-        .input_gpios = COLS,
-        .output_gpio_num = ROWS_LEN,
-        .input_gpio_num = COLS_LEN,
-        .active_level = 1,
-        .debounce_ticks = 2,
-        .ticks_interval = 1000, // us
-        .enable_power_save = false,
-        .priority = 5,
-        .core_id = APP_CPU_NUM,
-    };
-    ESP_ERROR_CHECK(keyboard_button_create(&cfg, &s_kbd));
-    keyboard_btn_cb_config_t cb_cfg = {};
-    cb_cfg.event = KBD_EVENT_PRESSED;
-    cb_cfg.callback = keyboard_cb;
-    ESP_ERROR_CHECK(keyboard_button_register_cb(s_kbd, cb_cfg, NULL));
+    xTaskCreatePinnedToCore(
+        HidTask,
+        "HidTask",
+        4096,
+        nullptr,
+        4,
+        &s_hid_task,
+        APP_CPU_NUM
+    );
+
+    s_usb_pm = power::lock(ESP_PM_APB_FREQ_MAX, "usb");
+    macro::setup(macro_wake);
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT1) {
+        // The boot is the wake. The wake stub caught the key that caused it while it was still
+        // down; its press goes first, and the matrix reports the release once it scans. Both
+        // wait for the link like keys after light sleep.
+        const int64_t now = esp_timer_get_time();
+        s_wake_us.store(now, std::memory_order_release);
+        // The scan has not started, so this is still the ring's only producer
+        matrix::Event woke[KEYS];
+        const uint8_t n = matrix::wakeKeys(woke);
+        for (uint8_t i = 0; i < n; i++) {
+            s_events.push({ now, woke[i].row, woke[i].col, true });
+        }
+        if (n) xTaskNotify(s_hid_task, HID_EVENTS, eSetBits);
+        ESP_LOGI(TAG, "woke from deep sleep; pins %llx, %u key(s) down", esp_sleep_get_ext1_wakeup_status(), n);
+    }
+    matrix::setup(ROWS, ROWS_LEN, COLS, COLS_LEN, keyboard_cb);
     tick();
     xTaskCreatePinnedToCore(
         LinkTask,
@@ -126,7 +460,11 @@ void setupKeyboard() {
         4096,
         nullptr,
         1,
-        nullptr,
+        &s_link_task,
         APP_CPU_NUM
     );
+
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(ret);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(VBUS_MONITOR_IO, vbus_isr, nullptr));
 }
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "key_state.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Layered keymap. Layouts are written as Action[layer][row][col] and flattened at
+// compile time into one table per combination of active layers, so a key press is
+// resolved with a single lookup whatever the layer state.
+namespace keymap {
+    typedef uint16_t Action;
+
+    // 0x00XX  HID usage XX
+    // 0x10LL  MO: layer LL while held
+    // 0x11LL  TG: toggle layer LL
+    // 0x2LXX  LT: HID usage XX on tap, layer L while held
+    // 0x3MXX  MT: HID usage XX on tap, modifier 0xE0 + M while held
+    constexpr Action NO = 0x0000;
+    // Falls through to the next active layer down; ErrorRollOver is never a real key
+    constexpr Action TRNS = 0x0001;
+
+    constexpr Action MO(uint8_t layer) { return 0x1000 | layer; }
+    constexpr Action TG(uint8_t layer) { return 0x1100 | layer; }
+    constexpr Action LT(uint8_t layer, uint8_t key) { return 0x2000 | (layer & 0xF) << 8 | key; }
+    constexpr Action MT(uint8_t mod, uint8_t key) { return 0x3000 | (mod & 0x7) << 8 | key; }
+
+    constexpr bool isKey(Action a) { return a >> 8 == 0; }
+    constexpr bool isMomentary(Action a) { return a >> 8 == 0x10; }
+    constexpr bool isToggle(Action a) { return a >> 8 == 0x11; }
+    constexpr bool isTapHold(Action a) { return a >> 12 == 2 || a >> 12 == 3; }
+    constexpr uint8_t layerOf(Action a) { return a >> 12 == 2 ? a >> 8 & 0xF : a & 0xFF; }
+    constexpr uint8_t tapOf(Action a) { return a & 0xFF; }
+    // What a tap-hold key turns into once it is held
+    constexpr Action holdOf(Action a) {
+        return a >> 12 == 2 ? MO(a >> 8 & 0xF) : Action(0xE0 + (a >> 8 & 0x7));
+    }
+
+    template <size_t LAYERS, size_t KEYS>
+    using Table = std::array<std::array<Action, KEYS>, (1 << LAYERS)>;
+
+    // resolved[mask][pos]: the highest active layer in mask that isn't transparent at pos.
+    // Layer 0 is always part of the lookup, whether or not its bit is set.
+    template <size_t LAYERS, size_t ROWS, size_t COLS>
+    constexpr Table<LAYERS, ROWS * COLS> flatten(const Action (&layers)[LAYERS][ROWS][COLS]) {
+        static_assert(LAYERS >= 1 && LAYERS <= 8, "keymap supports 1 to 8 layers");
+        Table<LAYERS, ROWS * COLS> t = {};
+        for (size_t mask = 0; mask < t.size(); mask++) {
+            for (size_t pos = 0; pos < ROWS * COLS; pos++) {
+                Action a = NO;
+                for (size_t l = LAYERS; l-- > 0;) {
+                    if (l && !(mask & (1 << l))) continue;
+                    const Action v = layers[l][pos / COLS][pos % COLS];
+                    if (v != TRNS) {
+                        a = v;
+                        break;
+                    }
+                }
+                t[mask][pos] = a;
+            }
+        }
+        return t;
+    }
+
+    // Turns key position events into KeyState changes. Not thread safe: one task owns it.
+    //
+    // A tap-hold key stays undecided until it is released (tap) or held past the tapping
+    // term (hold). Keys pressed meanwhile are buffered and resolved after the decision, so
+    // they see the right layer. With permissive hold, pressing and releasing another key
+    // inside the tap-hold also decides hold at once. Plain keys with nothing undecided
+    // are never delayed.
+    template <size_t LAYERS, size_t KEYS>
+    class Engine {
+    public:
+        struct Event {
+            int64_t us;
+            uint8_t pos;
+            bool pressed;
+        };
+
+        // flush sends an intermediate state, e.g. the press half of a tap before its release
+        Engine(const Table<LAYERS, KEYS> &table, int64_t term_us, bool permissive, void (*flush)(const KeyState &))
+            : table(table), termUs(term_us), permissive(permissive), flush(flush) {}
+
+        // Returns whether keys changed
+        bool process(const Event &e, KeyState &keys) {
+            if (!undecided) return apply(e, keys);
+            if (e.pos == pending.pos && !e.pressed) {
+                return decide(false, keys);
+            }
+            if (buffered == BUFFER_LEN) {
+                bool changed = decide(true, keys);
+                return process(e, keys) || changed;
+            }
+            buffer[buffered++] = e;
+            if (permissive && !e.pressed) {
+                for (uint8_t i = 0; i + 1 < buffered; i++) {
+                    if (buffer[i].pos == e.pos && buffer[i].pressed) return decide(true, keys);
+                }
+            }
+            return false;
+        }
+
+        // Time at which expire() has work to do, 0 if none
+        int64_t deadline() const {
+            return undecided ? pending.us + termUs : 0;
+        }
+
+        bool expire(int64_t now, KeyState &keys) {
+            if (!undecided || now < deadline()) return false;
+            return decide(true, keys);
+        }
+
+        uint8_t layers() const {
+            return activeMask();
+        }
+
+    private:
+        static constexpr uint8_t BUFFER_LEN = 8;
+
+        const Table<LAYERS, KEYS> &table;
+        const int64_t termUs;
+        const bool permissive;
+        void (*const flush)(const KeyState &);
+
+        // Action each held position resolved to when it went down
+        Action held[KEYS] = {};
+        uint8_t toggled = 0;
+        uint8_t momentary[LAYERS] = {};
+
+        bool undecided = false;
+        Event pending = {};
+        Event buffer[BUFFER_LEN];
+        uint8_t buffered = 0;
+
+        uint8_t activeMask() const {
+            uint8_t mask = toggled | 1;
+            for (uint8_t l = 1; l < LAYERS; l++) {
+                if (momentary[l]) mask |= 1 << l;
+            }
+            return mask;
+        }
+
+        bool apply(const Event &e, KeyState &keys) {
+            if (e.pos >= KEYS) return false;
+            if (!e.pressed) {
+                const Action a = held[e.pos];
+                held[e.pos] = NO;
+                if (isMomentary(a)) {
+                    if (momentary[layerOf(a) % LAYERS]) momentary[layerOf(a) % LAYERS]--;
+                    return false;
+                }
+                return isKey(a) && keys.release(a);
+            }
+            const Action a = table[activeMask()][e.pos];
+            held[e.pos] = a;
+            if (isTapHold(a)) {
+                undecided = true;
+                pending = e;
+                return false;
+            }
+            if (isMomentary(a)) {
+                momentary[layerOf(a) % LAYERS]++;
+                return false;
+            }
+            if (isToggle(a)) {
+                toggled ^= 1 << (layerOf(a) % LAYERS);
+                return false;
+            }
+            return isKey(a) && keys.press(a);
+        }
+
+        // Settle the undecided key, then run what was buffered behind it
+        bool decide(bool hold, KeyState &keys) {
+            undecided = false;
+            const Action a = held[pending.pos];
+            bool changed = false;
+            held[pending.pos] = NO;
+            if (hold) {
+                changed = pressAs(pending.pos, holdOf(a), keys);
+            } else {
+                if (keys.press(tapOf(a))) {
+                    flush(keys);
+                    changed = keys.release(tapOf(a));
+                }
+            }
+
+            Event replay[BUFFER_LEN];
+            const uint8_t n = buffered;
+            for (uint8_t i = 0; i < n; i++) replay[i] = buffer[i];
+            buffered = 0;
+            for (uint8_t i = 0; i < n; i++) {
+                // A buffered tap must reach the host as a press and a release
+                if (process(replay[i], keys)) {
+                    if (i + 1 < n) flush(keys);
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+
+        // Press a specific action rather than the one the table resolves to
+        bool pressAs(uint8_t pos, Action a, KeyState &keys) {
+            held[pos] = a;
+            if (isMomentary(a)) {
+                momentary[layerOf(a) % LAYERS]++;
+                return false;
+            }
+            return keys.press(a);
+        }
+    };
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Matrix wiring: rows are driven, columns are read
+constexpr int ROWS[] = {9, 10, 12, 13};
+constexpr int ROWS_LEN = sizeof(ROWS) / sizeof(ROWS[0]);
+constexpr int COLS[] = {3, 11, 14, 21};
+constexpr int COLS_LEN = sizeof(COLS) / sizeof(COLS[0]);
@@ -1,7 +1,10 @@
 #include "led.hpp"
 #include "mode.hpp"
+#include "metronome.hpp"
+#include "spsc_ring.hpp"
 
 extern "C" {
+    #include <sdkconfig.h>
     #include <freertos/FreeRTOS.h>
     #include <freertos/task.h>
     #include <led_strip.h>
@@ -10,10 +13,14 @@ extern "C" {
     #include <esp_log.h>
 }
 
+#include <array>
 #include <cmath>
+#include <cstring>
 
 #define LED_PWR_EN_PIN GPIO_NUM_45
 
+static const char *TAG = "LED";
+
 constexpr uint8_t LED_PLDS_LEN = 6;
 constexpr uint8_t LED_PLDS_PIN = 18;
 
@@ -34,6 +41,8 @@ constexpr uint8_t LED_MAX = 255;
 
 bool gFillDark = false;
 
+// The S3 has DMA on a single RMT TX channel, so only one strip can have it; the other
+// gets a deeper symbol buffer so its refill interrupts are fewer
 static void new_led(uint8_t gpio, uint16_t len, led_strip_handle_t* out, bool dma = false) {
     led_strip_config_t strip_config = {
         .strip_gpio_num = gpio,
@@ -47,7 +56,7 @@ static void new_led(uint8_t gpio, uint16_t len, led_strip_handle_t* out, bool dm
     led_strip_rmt_config_t rmt_config = {
         .clk_src = RMT_CLK_SRC_DEFAULT,
         .resolution_hz = 10 * 1000 * 1000,
-        .mem_block_symbols = 48,
+        .mem_block_symbols = dma ? 48u : 96u,
         .flags = {
             .with_dma = dma,
         }
@@ -55,77 +64,362 @@ static void new_led(uint8_t gpio, uint16_t len, led_strip_handle_t* out, bool dm
     ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, out));
 }
 
-static void set_pixel(led_strip_handle_t strip, uint16_t idx, uint8_t rgb[3], uint8_t scale) {
-    uint8_t rgb_t[3];
+// Frames in 8.8 fixed point, after gamma and brightness
+static uint16_t fb_main[LED_MAIN_LEN][3];
+static uint16_t fb_plds[LED_PLDS_LEN][3];
+// Fraction each channel still owes from earlier frames, for temporal dithering
+static uint8_t err_main[LED_MAIN_LEN][3];
+static uint8_t err_plds[LED_PLDS_LEN][3];
+// What each strip is showing, to skip refreshes that would send the same frame again
+static uint8_t shown_main[LED_MAIN_LEN][3];
+static uint8_t shown_plds[LED_PLDS_LEN][3];
+// Set when the strips were just created and show nothing yet
+static bool s_stale = true;
+
+// Key events from the scan callback; LEDTask is the only consumer
+struct LedKey {
+    int64_t us;
+    uint8_t row;
+    uint8_t col;
+    bool pressed;
+};
+
+static SpscRing<LedKey, 32> s_key_events;
+static TaskHandle_t s_led_task = nullptr;
+
+// Compile-time sine: Taylor series after folding into [-pi, pi]
+static constexpr double const_sin(double x) {
+    while (x > M_PI) x -= 2 * M_PI;
+    while (x < -M_PI) x += 2 * M_PI;
+    double term = x, sum = x;
+    for (int n = 1; n < 12; n++) {
+        term *= -x * x / ((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static constexpr double const_sqrt(double x) {
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 32; i++) r = (r + x / r) / 2;
+    return r;
+}
+
+template <typename T = uint8_t, typename F>
+static constexpr std::array<T, 256> make_lut(F f) {
+    std::array<T, 256> t = {};
+    for (int i = 0; i < 256; i++) t[i] = f(i);
+    return t;
+}
+
+// 0..255 over one turn, 128 at zero phase
+static constexpr auto SIN8 = make_lut([](int i) {
+    return (uint8_t)((0.5 + 0.5 * const_sin(i * 2 * M_PI / 256)) * 255 + 0.5);
+});
+// Gamma 2.25 (x^2 * x^1/4, close to 2.2 and exact at compile time) and the global brightness
+// cap in one step, kept in 8.8 so the dimmed range doesn't collapse to a handful of levels
+static constexpr auto GAMMA = make_lut<uint16_t>([](int i) {
+    const double x = i / 255.0;
+    return (uint16_t)(x * x * const_sqrt(const_sqrt(x)) * LED_BRT * 256 + 0.5);
+});
+
+static constexpr uint16_t const_isqrt(uint16_t v) {
+    uint16_t r = 0;
+    while ((r + 1) * (r + 1) <= v) r++;
+    return r;
+}
+
+// Distance between two keys in 1/16 of a key, indexed like the strip
+static constexpr auto DIST = [] {
+    std::array<std::array<uint8_t, LED_MAIN_LEN>, LED_MAIN_LEN> t = {};
+    for (int a = 0; a < LED_MAIN_LEN; a++) {
+        for (int b = 0; b < LED_MAIN_LEN; b++) {
+            const int dc = a / LED_MAIN_ROWS - b / LED_MAIN_ROWS;
+            const int dr = a % LED_MAIN_ROWS - b % LED_MAIN_ROWS;
+            t[a][b] = const_isqrt((dc * dc + dr * dr) * 256);
+        }
+    }
+    return t;
+}();
+
+static inline uint8_t scale8(uint8_t v, uint8_t scale) {
+    // Never rounds a lit channel down to off
+    return (v * scale >> 8) + (v && scale);
+}
+
+static void set_pixel(uint16_t (*fb)[3], uint16_t idx, const uint8_t rgb[3], uint8_t scale) {
     for (uint8_t i = 0; i < 3; i++) {
-        uint16_t res = (uint16_t)rgb[i] * (uint16_t)scale;
-        res >>= 8;
-        if (rgb[i] && scale) res += 1;
-        if (res > 255) res = 255;
-        uint32_t scaled = (uint32_t)res * LED_BRT / 255;
-        rgb_t[i] = (uint8_t)(scaled);
+        fb[idx][i] = GAMMA[scale8(rgb[i], scale)];
+    }
+}
+
+// First-order temporal dithering: carry each channel's dropped fraction into the next frame,
+// so over a few frames the average output matches the 8.8 value
+static void dither(const uint16_t (*fb)[3], uint8_t (*err)[3], uint8_t (*out)[3], uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        for (uint8_t c = 0; c < 3; c++) {
+            const uint16_t v = fb[i][c] + err[i][c];
+            out[i][c] = v >> 8;
+            err[i][c] = v & 0xFF;
+        }
+    }
+}
+
+static inline uint8_t qadd8(uint8_t a, uint8_t b) {
+    return a + b > 255 ? 255 : a + b;
+}
+
+/* KEY EFFECTS: held keys light up, a released key leaves a fading trail, a press sends a ring outwards */
+constexpr int64_t FRAME_US = 4000;
+constexpr uint8_t TRAIL_DECAY = 236;    // per frame, Q8: half-life about 40 ms
+constexpr uint8_t RIPPLES = 4;
+constexpr int64_t RIPPLE_US_PER_KEY = 60000;
+constexpr int64_t RIPPLE_LIFE_US = 360000;
+
+struct Ripple {
+    int64_t us;
+    uint8_t origin;
+};
+
+static bool s_held[LED_MAIN_LEN];
+static uint8_t s_trail[LED_MAIN_LEN];
+static Ripple s_ripples[RIPPLES];
+static uint8_t s_ripple_next = 0;
+static int64_t s_decay_us = 0;
+
+static void fx_key(const LedKey &k) {
+    if (k.row >= LED_MAIN_ROWS || k.col >= LED_MAIN_COLS) return;
+    const uint8_t idx = k.col * LED_MAIN_ROWS + k.row;
+    s_held[idx] = k.pressed;
+    if (k.pressed) {
+        s_ripples[s_ripple_next] = { k.us, idx };
+        s_ripple_next = (s_ripple_next + 1) % RIPPLES;
+    } else {
+        s_trail[idx] = 255;
     }
-    led_strip_set_pixel(strip, idx, rgb_t[0], rgb_t[1], rgb_t[2]);
 }
 
-static void clear_led() {
-    led_strip_clear(led_main);
-    led_strip_clear(led_plds);
+// Key light per pixel; trails decay by elapsed time, so early frames don't speed them up
+static void fx_render(int64_t now, uint8_t level[LED_MAIN_LEN]) {
+    // After a long gap every trail has long gone dark anyway
+    if (now - s_decay_us > 64 * FRAME_US) s_decay_us = now - 64 * FRAME_US;
+    for (; now - s_decay_us >= FRAME_US; s_decay_us += FRAME_US) {
+        for (uint8_t i = 0; i < LED_MAIN_LEN; i++) {
+            s_trail[i] = s_trail[i] * TRAIL_DECAY >> 8;
+        }
+    }
+
+    for (uint8_t i = 0; i < LED_MAIN_LEN; i++) {
+        level[i] = s_held[i] ? 255 : s_trail[i];
+    }
+    for (const auto &r : s_ripples) {
+        const int64_t age = now - r.us;
+        if (!r.us || age < 0 || age >= RIPPLE_LIFE_US) continue;
+        const int32_t radius = age * 16 / RIPPLE_US_PER_KEY;
+        const uint32_t fade = (RIPPLE_LIFE_US - age) * 256 / RIPPLE_LIFE_US;
+        for (uint8_t i = 0; i < LED_MAIN_LEN; i++) {
+            const int32_t off = DIST[r.origin][i] - radius;
+            const int32_t dist = off < 0 ? -off : off;
+            if (dist >= 16) continue;
+            level[i] = qadd8(level[i], (16 - dist) * 15 * fade >> 8);
+        }
+    }
+}
+
+// The RMT driver holds a PM lock for as long as a channel is enabled, and led_strip can only
+// give the channel back by deleting the strip; LEDTask does both, so only it touches them
+static void new_strips() {
+    new_led(LED_MAIN_PIN, LED_MAIN_LEN, &led_main, true);
+    new_led(LED_PLDS_PIN, LED_PLDS_LEN, &led_plds);
+    s_stale = true;
+}
+
+static void del_strips() {
+    if (!led_main) return;
+    led_strip_refresh_wait(led_main);
+    led_strip_refresh_wait(led_plds);
+    ESP_ERROR_CHECK(led_strip_del(led_main));
+    ESP_ERROR_CHECK(led_strip_del(led_plds));
+    led_main = nullptr;
+    led_plds = nullptr;
 }
 
 void fillDark() {
     gFillDark = true;
-    clear_led();
     gpio_set_level(LED_PWR_EN_PIN, 0);
 }
 
 void restoreLED() {
     gpio_set_level(LED_PWR_EN_PIN, 1);
-    clear_led();
     gFillDark = false;
+    if (s_led_task) xTaskNotifyGive(s_led_task);
+}
+
+static uint8_t beat8(int64_t now_us, uint16_t bpm) {
+    return (uint64_t)now_us * bpm * 256 / 60000000;
 }
 
-static uint8_t beat8(uint16_t bpm) {
-    uint32_t ms = (uint32_t)(esp_timer_get_time() / 1000);
-    uint32_t v = (uint32_t)((uint64_t)ms * bpm * 256ull / 60000ull);
-    return (uint8_t)v;
+static uint8_t beatsin8(int64_t now_us, uint16_t bpm, uint8_t lo, uint8_t hi, uint8_t phase = 0) {
+    uint8_t b = beat8(now_us, bpm) + phase;
+    return lo + (SIN8[b] * (hi - lo + 1) >> 8);
 }
 
-static uint8_t beatsin8(uint16_t bpm, uint8_t lo, uint8_t hi, uint8_t phase = 0) {
-    uint8_t b = beat8(bpm) + phase;
-    float theta = (float)b * (2.0f * (float)M_PI / 256.0f);
-    uint8_t s = (uint8_t)lroundf((0.5f + 0.5f * sinf(theta)) * 255.0f);
-    uint16_t span = (uint16_t)(hi - lo);
-    return (uint8_t)(lo + (uint16_t)s * span / 255);
+// Start sending a strip's frame if it differs from what it shows; returns whether it did.
+// The strip's own pixel buffer is only touched once its previous frame is out, so the
+// next frame is composed in fb while this one is still on the wire.
+static bool commit(led_strip_handle_t strip, const uint8_t (*out)[3], uint8_t (*shown)[3], uint16_t len, bool force) {
+    if (!force && !memcmp(out, shown, len * 3)) return false;
+    led_strip_refresh_wait(strip);
+    for (uint16_t i = 0; i < len; i++) {
+        led_strip_set_pixel(strip, i, out[i][0], out[i][1], out[i][2]);
+    }
+    memcpy(shown, out, len * 3);
+    led_strip_refresh_async(strip);
+    return true;
+}
+
+#ifdef CONFIG_KEYBOARD_LED_STATS
+constexpr bool LED_STATS = true;
+#else
+constexpr bool LED_STATS = false;
+#endif
+
+struct FrameStats {
+    uint32_t frames;
+    uint32_t refreshes;
+    uint64_t renderUs;  // composing the frame
+    uint32_t renderMaxUs;
+    uint64_t busyUs;    // composing plus pushing it to the strips
+    uint32_t busyMaxUs;
+    uint32_t photonMaxUs;   // key reported by the scan to its frame going out, plus ~0.5 ms on the wire
+    // Start-to-start of frames run on the timer, 250 us bins from 3 ms; the ends catch the rest
+    uint32_t intervalHist[8];
+};
+
+static FrameStats s_frame_stats = {};
+constexpr uint32_t STATS_FRAMES = 2500;
+
+void ledKey(uint8_t row, uint8_t col, bool pressed, int64_t us) {
+    s_key_events.push({ us, row, col, pressed });
+    if (s_led_task) xTaskNotifyGive(s_led_task);
+}
+
+// Sleep until the next 4 ms frame, or less if a key comes in: a key is drawn right away.
+// Returns whether the frame is a timed one.
+static bool wait_frame(TickType_t &next, TickType_t period) {
+    const TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(next - now) <= 0) {
+        next += period;
+        if ((int32_t)(next - now) <= 0) next = now + period;
+    }
+    return !ulTaskNotifyTake(pdTRUE, next - now);
 }
 
 static void LEDTask(void*) {
-    constexpr TickType_t period = pdMS_TO_TICKS(4);
-    TickType_t last = xTaskGetTickCount();
-    uint8_t rgb[3] = {0x00, 0xBC, 0xD4};
+    constexpr TickType_t period = pdMS_TO_TICKS(FRAME_US / 1000);
+    TickType_t next = xTaskGetTickCount();
+    const uint8_t rgb[3] = {0x00, 0xBC, 0xD4};
+    const uint8_t accent_rgb[3] = {0xFF, 0x6D, 0x00};
+    const uint8_t key_rgb[3] = {0xFF, 0xFF, 0xFF};
+    uint8_t key_level[LED_MAIN_LEN];
+    uint8_t out_main[LED_MAIN_LEN][3];
+    uint8_t out_plds[LED_PLDS_LEN][3];
+    bool timed = false;
+    int64_t last_timed = 0;
     for (;;) {
+        LedKey k;
+        int64_t key_us = 0;
+        while (s_key_events.pop(k)) {
+            if (!key_us) key_us = k.us;
+            fx_key(k);
+        }
         if (gFillDark) {
-            vTaskDelayUntil(&last, period);
+            // Keys still feed the effects; nothing else wakes the task until restoreLED()
+            del_strips();
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            next = xTaskGetTickCount();
+            timed = false;
+            last_timed = 0;
             continue;
         }
-        /* WAVING LIGHTS */
-        for (uint8_t col = 0; col < LED_MAIN_COLS; ++col) {
-            uint16_t phase = col * LED_PHASE;
-            uint8_t level = beatsin8(LED_BPM, LED_MIN, LED_MAX, phase);
-            for (uint8_t row = 0; row < LED_MAIN_ROWS; ++row) {
-                set_pixel(led_main, (col * LED_MAIN_COLS) + row, rgb, level);
+        if (!led_main) new_strips();
+        const int64_t start = esp_timer_get_time();
+        if (LED_STATS && timed && last_timed) {
+            const int64_t bin = (start - last_timed - 3000) / 250;
+            s_frame_stats.intervalHist[bin < 0 ? 0 : bin > 7 ? 7 : bin]++;
+        }
+        if (timed) last_timed = start;
+        auto beat = metronome::phase(start);
+        if (gBootMode == BootMode::METRONOME && beat.running) {
+            /* BEAT LIGHTS: flash on the click, decay through the beat, one column per beat of the bar */
+            const uint8_t *color = beat.accent ? accent_rgb : rgb;
+            for (uint8_t col = 0; col < LED_MAIN_COLS; ++col) {
+                uint8_t level = col == beat.beat % LED_MAIN_COLS ? 255 - beat.frac : LED_MIN / 4;
+                for (uint8_t row = 0; row < LED_MAIN_ROWS; ++row) {
+                    set_pixel(fb_main, (col * LED_MAIN_COLS) + row, color, level);
+                }
+            }
+            memset(fb_plds, 0, sizeof(fb_plds));
+            set_pixel(fb_plds, (uint8_t)gBootMode, color, 255 - beat.frac);
+        } else {
+            /* WAVING LIGHTS */
+            for (uint8_t col = 0; col < LED_MAIN_COLS; ++col) {
+                uint8_t phase = col * LED_PHASE;
+                uint8_t level = beatsin8(start, LED_BPM, LED_MIN, LED_MAX, phase);
+                for (uint8_t row = 0; row < LED_MAIN_ROWS; ++row) {
+                    set_pixel(fb_main, (col * LED_MAIN_COLS) + row, rgb, level);
+                }
             }
+            /* PLD LIGHTS */
+            memset(fb_plds, 0, sizeof(fb_plds));
+            set_pixel(fb_plds, (uint8_t)gBootMode, rgb, (255 - beat8(start, LED_BPM)) >> 1);
         }
-        /* KEYS HIGHLIGHTING LIGHTS */
-        /* TODO */
 
-        /* PLD LIGHTS */
-        uint8_t m = (uint8_t)(gBootMode);
-        set_pixel(led_plds, m, rgb, ((255 - (uint8_t)beat8(LED_BPM)) * 0.5f));
+        /* KEYS HIGHLIGHTING LIGHTS */
+        fx_render(start, key_level);
+        for (uint8_t i = 0; i < LED_MAIN_LEN; i++) {
+            if (!key_level[i]) continue;
+            for (uint8_t c = 0; c < 3; c++) {
+                const uint16_t v = GAMMA[scale8(key_rgb[c], key_level[i])];
+                if (v > fb_main[i][c]) fb_main[i][c] = v;
+            }
+        }
 
-        led_strip_refresh(led_main);
-        led_strip_refresh(led_plds);
-        vTaskDelayUntil(&last, period);
+        const int64_t rendered = LED_STATS ? esp_timer_get_time() : 0;
+        const bool force = s_stale;
+        s_stale = false;
+        dither(fb_main, err_main, out_main, LED_MAIN_LEN);
+        dither(fb_plds, err_plds, out_plds, LED_PLDS_LEN);
+        uint32_t refreshes = commit(led_main, out_main, shown_main, LED_MAIN_LEN, force);
+        refreshes += commit(led_plds, out_plds, shown_plds, LED_PLDS_LEN, force);
+        if (LED_STATS) {
+            const int64_t shown = esp_timer_get_time();
+            const uint32_t render = rendered - start;
+            const uint32_t busy = shown - start;
+            s_frame_stats.refreshes += refreshes;
+            if (key_us && shown - key_us > s_frame_stats.photonMaxUs) s_frame_stats.photonMaxUs = shown - key_us;
+            s_frame_stats.renderUs += render;
+            if (render > s_frame_stats.renderMaxUs) s_frame_stats.renderMaxUs = render;
+            s_frame_stats.busyUs += busy;
+            if (busy > s_frame_stats.busyMaxUs) s_frame_stats.busyMaxUs = busy;
+            if (++s_frame_stats.frames == STATS_FRAMES) {
+                const auto &st = s_frame_stats;
+                ESP_LOGI(
+                    TAG, "%" PRIu32 " frames: render avg %" PRIu32 " max %" PRIu32 " us, busy avg %" PRIu32 " max %" PRIu32 " us, "
+                    "%" PRIu32 " of %" PRIu32 " refreshes skipped, key to photon max %" PRIu32 " us",
+                    st.frames, (uint32_t)(st.renderUs / st.frames), st.renderMaxUs, (uint32_t)(st.busyUs / st.frames), st.busyMaxUs,
+                    st.frames * 2 - st.refreshes, st.frames * 2, st.photonMaxUs
+                );
+                const uint32_t *h = st.intervalHist;
+                ESP_LOGI(
+                    TAG, "frame interval <3.25:%" PRIu32 " <3.5:%" PRIu32 " <3.75:%" PRIu32 " <4:%" PRIu32
+                    " <4.25:%" PRIu32 " <4.5:%" PRIu32 " <4.75:%" PRIu32 " more:%" PRIu32,
+                    h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]
+                );
+                s_frame_stats = {};
+            }
+        }
+        timed = wait_frame(next, period);
     }
 }
 
@@ -139,9 +433,6 @@ void setupLED() {
     };
     gpio_config(&io);
 
-    new_led(LED_MAIN_PIN, LED_MAIN_LEN, &led_main);
-    new_led(LED_PLDS_PIN, LED_PLDS_LEN, &led_plds, true);
-    
     restoreLED();
     xTaskCreatePinnedToCore(
         LEDTask,
@@ -149,7 +440,7 @@ void setupLED() {
         8192,
         nullptr,
         2,
-        nullptr,
+        &s_led_task,
         APP_CPU_NUM
     );
 }
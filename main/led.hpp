@@ -2,6 +2,11 @@
 
 #include <cstdint>
 
+// Set while fillDark() has the LED rail switched off
+extern bool gFillDark;
+
 void setupLED();
 void fillDark();
 void restoreLED();
+// Called from the scan callback; never blocks
+void ledKey(uint8_t row, uint8_t col, bool pressed, int64_t us);
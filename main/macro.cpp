@@ -0,0 +1,163 @@
+#include "macro.hpp"
+
+extern "C" {
+    #include <class/hid/hid.h>
+    #include <esp_timer.h>
+    #include <esp_log.h>
+}
+
+namespace macro {
+
+static const char *TAG = "MACRO";
+
+static const uint8_t Ascii[128][2] = { HID_ASCII_TO_KEYCODE };
+
+static esp_timer_handle_t s_timer = nullptr;
+static void (*s_wake)() = nullptr;
+
+static const uint8_t *pc = nullptr;
+static uint8_t s_owner = 0;
+static uint32_t s_frame_us = 0;
+// Absolute time of the next step, so pacing doesn't drift with how late each step ran
+static int64_t next_us = 0;
+static int64_t start_us = 0;
+// Keys the macro itself holds, released on abort without touching the user's
+static KeyState held;
+// Rest of the TEXT op, and the key of a TAP or character still to be released
+static uint8_t text_left = 0;
+static uint8_t tap_key = 0;
+static bool tap_shift = false;
+
+static void timer_cb(void*) {
+    s_wake();
+}
+
+void setup(void (*wake)()) {
+    s_wake = wake;
+    const esp_timer_create_args_t args = {
+        .callback = timer_cb,
+        .arg = nullptr,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "macro",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &s_timer));
+}
+
+static void schedule(uint32_t delay_us) {
+    const int64_t now = esp_timer_get_time();
+    next_us += delay_us;
+    if (next_us < now) next_us = now;
+    esp_timer_stop(s_timer);
+    ESP_ERROR_CHECK(esp_timer_start_once(s_timer, next_us - now));
+}
+
+void start(const uint8_t *code, uint8_t pos, uint32_t frame_us) {
+    pc = code;
+    s_owner = pos;
+    s_frame_us = frame_us;
+    text_left = 0;
+    tap_key = 0;
+    start_us = next_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "key %u: playing, %" PRIu32 " us per report", pos, frame_us);
+    schedule(0);
+}
+
+// Only keys the macro itself put down are its to release
+static bool press(KeyState &keys, uint8_t key) {
+    if (!keys.press(key)) return false;
+    held.press(key);
+    return true;
+}
+
+static bool release(KeyState &keys, uint8_t key) {
+    if (!held.release(key)) return false;
+    return keys.release(key);
+}
+
+static bool finish(KeyState &keys) {
+    esp_timer_stop(s_timer);
+    pc = nullptr;
+    text_left = 0;
+    tap_key = 0;
+    bool changed = false;
+    for (uint16_t key = 1; key < 256; key++) {
+        changed |= release(keys, key);
+    }
+    return changed;
+}
+
+bool abort(KeyState &keys) {
+    if (!pc) return false;
+    ESP_LOGI(TAG, "key %u: aborted after %" PRId64 " ms", s_owner, (esp_timer_get_time() - start_us) / 1000);
+    return finish(keys);
+}
+
+bool running() {
+    return pc;
+}
+
+uint8_t owner() {
+    return s_owner;
+}
+
+bool step(KeyState &keys) {
+    if (!pc) return false;
+    for (;;) {
+        if (tap_key) {
+            bool changed = release(keys, tap_key);
+            if (tap_shift) changed |= release(keys, HID_KEY_SHIFT_LEFT);
+            tap_key = 0;
+            if (changed) {
+                schedule(s_frame_us);
+                return true;
+            }
+            continue;
+        }
+        if (text_left) {
+            const uint8_t c = *pc++ & 0x7F;
+            text_left--;
+            if (!Ascii[c][1]) continue;
+            tap_shift = Ascii[c][0];
+            bool changed = tap_shift && press(keys, HID_KEY_SHIFT_LEFT);
+            changed |= press(keys, Ascii[c][1]);
+            tap_key = Ascii[c][1];
+            if (changed) {
+                schedule(s_frame_us);
+                return true;
+            }
+            continue;
+        }
+
+        bool changed = false;
+        switch (*pc++) {
+            case PRESS:
+                changed = press(keys, *pc++);
+                break;
+            case RELEASE:
+                changed = release(keys, *pc++);
+                break;
+            case TAP:
+                tap_key = *pc++;
+                tap_shift = false;
+                changed = press(keys, tap_key);
+                break;
+            case DELAY:
+                schedule((pc[0] | pc[1] << 8) * 1000);
+                pc += 2;
+                return false;
+            case TEXT:
+                text_left = *pc++;
+                break;
+            default:
+                ESP_LOGI(TAG, "key %u: done in %" PRId64 " ms", s_owner, (esp_timer_get_time() - start_us) / 1000);
+                return finish(keys);
+        }
+        if (changed) {
+            schedule(s_frame_us);
+            return true;
+        }
+    }
+}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include "key_state.hpp"
+
+// Macro playback for BootMode::MACRO.
+// A macro is bytecode kept in flash, one op byte followed by its operands:
+//   PRESS key, RELEASE key, TAP key, DELAY ms_lo ms_hi, TEXT len chars..., END
+
+namespace macro {
+    enum Op : uint8_t {
+        END,
+        PRESS,
+        RELEASE,
+        TAP,
+        DELAY,
+        TEXT,
+    };
+
+    // wake() runs on the esp_timer task whenever the player is due for its next step
+    void setup(void (*wake)());
+    // frame_us is the spacing between reports the link can take
+    void start(const uint8_t *code, uint8_t pos, uint32_t frame_us);
+    // Releases whatever the macro holds; returns whether keys changed
+    bool abort(KeyState &keys);
+    bool running();
+    // Key position that started the running macro
+    uint8_t owner();
+    // Runs ops up to the next report or delay; returns whether keys changed
+    bool step(KeyState &keys);
+}
+
+// DELAY with its operand split into bytes
+#define MACRO_DELAY(ms) macro::DELAY, (uint8_t)((ms) & 0xFF), (uint8_t)((ms) >> 8)
@@ -1,15 +1,18 @@
 #include "mode.hpp"
 #include "ota.hpp"
 #include "battery.hpp"
+#include "ble_hid.hpp"
 #include "keyboard.hpp"
 #include "metronome.hpp"
 #include "led.hpp"
+#include "power.hpp"
 
 extern "C" void app_main(void) {
+    setupPower();
     setupKeyboard();
     setupMode();
     setupOTA();
-    setupBattery();
+    setupBattery(ble_hid::battery);
     setupMetronome();
     setupLED();
 }
@@ -0,0 +1,277 @@
+#include "matrix.hpp"
+#include "debounce.hpp"
+#include "power.hpp"
+
+extern "C" {
+    #include <sdkconfig.h>
+    #include <freertos/FreeRTOS.h>
+    #include <freertos/task.h>
+    #include <driver/gpio.h>
+    #include <driver/rtc_io.h>
+    #include <esp_sleep.h>
+    #include <hal/gpio_ll.h>
+    #include <soc/gpio_struct.h>
+    #include <esp_rom_sys.h>
+    #include <esp_rom_gpio.h>
+    #include <esp_attr.h>
+    #include <soc/gpio_reg.h>
+    #include <soc/gpio_sig_map.h>
+    #include <soc/rtc_cntl_reg.h>
+    #include <soc/rtc_io_reg.h>
+    #include <esp_log.h>
+}
+
+namespace matrix {
+
+static const char *TAG = "MATRIX";
+
+constexpr uint8_t MAX_ROWS = 8;
+constexpr uint8_t MAX_COLS = 8;
+constexpr uint32_t SETTLE_US = 3;
+constexpr uint8_t DEBOUNCE_SCANS = CONFIG_KEYBOARD_DEBOUNCE_MS;
+constexpr TickType_t SCAN_TICKS = pdMS_TO_TICKS(1);
+// All keys up for this many scans before parking on the column interrupt
+constexpr uint16_t IDLE_SCANS = 50;
+
+static const int *s_rows = nullptr;
+static uint8_t s_rows_len = 0;
+static const int *s_cols = nullptr;
+static uint8_t s_cols_len = 0;
+static Callback s_cb = nullptr;
+static TaskHandle_t s_task = nullptr;
+static volatile bool s_parked = false;
+// Held while scanning, so the chip only light sleeps or drops its clock once parked
+static esp_pm_lock_handle_t s_pm = nullptr;
+
+#if CONFIG_KEYBOARD_DEBOUNCE_EAGER
+constexpr debounce::Algo DEBOUNCE = debounce::Algo::EAGER_PRESS;
+#elif CONFIG_KEYBOARD_DEBOUNCE_EAGER_BOTH
+constexpr debounce::Algo DEBOUNCE = debounce::Algo::EAGER;
+#else
+constexpr debounce::Algo DEBOUNCE = debounce::Algo::DEFERRED;
+#endif
+
+static debounce::Key s_keys[MAX_ROWS][MAX_COLS] = {};
+
+// The deep sleep wake stub only sees RTC memory: the pins go there when sleep is armed, and the
+// stub leaves a column mask per row of the keys it found down. No rows means nothing to scan.
+RTC_DATA_ATTR static uint8_t s_wake_rows[MAX_ROWS];
+RTC_DATA_ATTR static uint8_t s_wake_cols[MAX_COLS];
+RTC_DATA_ATTR static uint8_t s_wake_rows_len = 0;
+RTC_DATA_ATTR static uint8_t s_wake_cols_len = 0;
+RTC_DATA_ATTR static uint8_t s_wake_keys[MAX_ROWS] = {};
+
+static void IRAM_ATTR col_isr(void*) {
+    BaseType_t woken = pdFALSE;
+    for (uint8_t c = 0; c < s_cols_len; c++) {
+        gpio_ll_intr_disable(&GPIO, s_cols[c]);
+    }
+    vTaskNotifyGiveFromISR(s_task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+// Drive every row and sleep until any column goes high
+static void wait_for_key() {
+    for (uint8_t r = 0; r < s_rows_len; r++) {
+        gpio_set_level((gpio_num_t)s_rows[r], 1);
+    }
+    esp_rom_delay_us(SETTLE_US);
+    ulTaskNotifyTake(pdTRUE, 0);
+    for (uint8_t c = 0; c < s_cols_len; c++) {
+        gpio_intr_enable((gpio_num_t)s_cols[c]);
+    }
+    s_parked = true;
+    power::release(s_pm);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    power::acquire(s_pm);
+    s_parked = false;
+    for (uint8_t r = 0; r < s_rows_len; r++) {
+        gpio_set_level((gpio_num_t)s_rows[r], 0);
+    }
+}
+
+// Any column going high wakes the chip from light sleep, automatic or the idle stage's
+static void arm_light_wake() {
+    for (uint8_t c = 0; c < s_cols_len; c++) {
+        ESP_ERROR_CHECK(gpio_wakeup_enable((gpio_num_t)s_cols[c], GPIO_INTR_HIGH_LEVEL));
+    }
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+}
+
+static void MatrixTask(void*) {
+    Event events[MAX_ROWS * MAX_COLS];
+    uint16_t idle = 0;
+    power::acquire(s_pm);
+    TickType_t last = xTaskGetTickCount();
+    for (;;) {
+        uint8_t n = 0;
+        bool busy = false;
+        for (uint8_t r = 0; r < s_rows_len; r++) {
+            gpio_set_level((gpio_num_t)s_rows[r], 1);
+            esp_rom_delay_us(SETTLE_US);
+            for (uint8_t c = 0; c < s_cols_len; c++) {
+                auto &k = s_keys[r][c];
+                bool raw = gpio_get_level((gpio_num_t)s_cols[c]);
+                if (debounce::update(DEBOUNCE, k, raw, DEBOUNCE_SCANS)) {
+                    events[n++] = { r, c, k.state };
+                }
+                busy |= raw || !debounce::settled(k);
+            }
+            gpio_set_level((gpio_num_t)s_rows[r], 0);
+        }
+        if (n) s_cb(events, n);
+
+        if (busy) {
+            idle = 0;
+        } else if (++idle >= IDLE_SCANS) {
+            wait_for_key();
+            idle = 0;
+            last = xTaskGetTickCount();
+            continue;
+        }
+        vTaskDelayUntil(&last, SCAN_TICKS);
+    }
+}
+
+void setup(const int *rows, uint8_t rows_len, const int *cols, uint8_t cols_len, Callback cb) {
+    assert(rows_len <= MAX_ROWS && cols_len <= MAX_COLS);
+    s_rows = rows;
+    s_rows_len = rows_len;
+    s_cols = cols;
+    s_cols_len = cols_len;
+    s_cb = cb;
+
+    // Keys the wake stub found down start out held, so the scan reports their release
+    for (uint8_t r = 0; r < rows_len; r++) {
+        for (uint8_t c = 0; c < cols_len; c++) {
+            if (s_wake_keys[r] & (1 << c)) s_keys[r][c] = { true, 0 };
+        }
+        s_wake_keys[r] = 0;
+    }
+
+    uint64_t row_mask = 0;
+    for (uint8_t r = 0; r < rows_len; r++) {
+        row_mask |= 1ULL << rows[r];
+        // Still held if this boot is a wake from deep sleep
+        gpio_hold_dis((gpio_num_t)rows[r]);
+    }
+    gpio_config_t io = {
+        .pin_bit_mask = row_mask,
+        .mode = GPIO_MODE_OUTPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    gpio_config(&io);
+    for (uint8_t r = 0; r < rows_len; r++) {
+        gpio_set_level((gpio_num_t)rows[r], 0);
+    }
+
+    uint64_t col_mask = 0;
+    for (uint8_t c = 0; c < cols_len; c++) {
+        col_mask |= 1ULL << cols[c];
+    }
+    io.pin_bit_mask = col_mask;
+    io.mode = GPIO_MODE_INPUT;
+    io.pull_down_en = GPIO_PULLDOWN_ENABLE;
+    io.intr_type = GPIO_INTR_HIGH_LEVEL;
+    gpio_config(&io);
+
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(ret);
+    for (uint8_t c = 0; c < cols_len; c++) {
+        gpio_intr_disable((gpio_num_t)cols[c]);
+        ESP_ERROR_CHECK(gpio_isr_handler_add((gpio_num_t)cols[c], col_isr, nullptr));
+    }
+    arm_light_wake();
+    s_pm = power::lock(ESP_PM_CPU_FREQ_MAX, "matrix");
+
+    xTaskCreatePinnedToCore(
+        MatrixTask,
+        "MatrixTask",
+        4096,
+        nullptr,
+        5,
+        &s_task,
+        APP_CPU_NUM
+    );
+    ESP_LOGI(TAG, "%ux%u matrix, %u ms %s debounce", rows_len, cols_len, DEBOUNCE_SCANS, debounce::name(DEBOUNCE));
+}
+
+bool parked() {
+    return s_parked;
+}
+
+void armDeepWake(uint64_t extra) {
+    for (uint8_t r = 0; r < s_rows_len; r++) {
+        gpio_set_level((gpio_num_t)s_rows[r], 1);
+        gpio_hold_en((gpio_num_t)s_rows[r]);
+    }
+    // The column pull-downs are RTC pads while asleep and need their domain kept up
+    uint64_t mask = extra;
+    for (uint8_t c = 0; c < s_cols_len; c++) {
+        mask |= 1ULL << s_cols[c];
+        rtc_gpio_pullup_dis((gpio_num_t)s_cols[c]);
+        rtc_gpio_pulldown_en((gpio_num_t)s_cols[c]);
+    }
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON);
+    ESP_ERROR_CHECK(esp_sleep_enable_ext1_wakeup_io(mask, ESP_EXT1_WAKEUP_ANY_HIGH));
+
+    // The stub releases the row holds through the RTC pad hold bits, which only cover RTC pads
+    s_wake_rows_len = 0;
+    for (uint8_t r = 0; r < s_rows_len; r++) {
+        if (!rtc_gpio_is_valid_gpio((gpio_num_t)s_rows[r])) return;
+        s_wake_rows[r] = s_rows[r];
+    }
+    for (uint8_t c = 0; c < s_cols_len; c++) {
+        s_wake_cols[c] = s_cols[c];
+    }
+    s_wake_cols_len = s_cols_len;
+    s_wake_rows_len = s_rows_len;
+}
+
+uint8_t wakeKeys(Event *events) {
+    uint8_t n = 0;
+    for (uint8_t r = 0; r < s_wake_rows_len; r++) {
+        for (uint8_t c = 0; c < s_wake_cols_len; c++) {
+            if (s_wake_keys[r] & (1 << c)) events[n++] = { r, c, true };
+        }
+    }
+    return n;
+}
+
+}
+
+// Runs out of RTC memory straight from deep sleep, well before the app, so a tap that woke the
+// board is still down. Only RTC data, registers and ROM calls are usable this early; no flash.
+extern "C" void RTC_IRAM_ATTR esp_wake_deep_sleep(void) {
+    esp_default_wake_deep_sleep();
+    using namespace matrix;
+    uint32_t rows = 0;
+    for (uint8_t r = 0; r < s_wake_rows_len; r++) {
+        rows |= 1u << s_wake_rows[r];
+    }
+    if (!rows) return;
+
+    // Take the rows over as plain outputs, low, then let go of the hold that kept them high
+    REG_WRITE(GPIO_OUT_W1TC_REG, rows);
+    for (uint8_t r = 0; r < s_wake_rows_len; r++) {
+        esp_rom_gpio_pad_select_gpio(s_wake_rows[r]);
+        esp_rom_gpio_connect_out_signal(s_wake_rows[r], SIG_GPIO_OUT_IDX, false, false);
+    }
+    REG_WRITE(GPIO_ENABLE_W1TS_REG, rows);
+    REG_CLR_BIT(RTC_CNTL_PAD_HOLD_REG, rows);
+
+    // The columns are still routed to the RTC pads the ext1 wakeup reads
+    for (uint8_t r = 0; r < s_wake_rows_len; r++) {
+        REG_WRITE(GPIO_OUT_W1TS_REG, 1u << s_wake_rows[r]);
+        esp_rom_delay_us(SETTLE_US);
+        const uint32_t in = REG_READ(RTC_GPIO_IN_REG) >> RTC_GPIO_IN_NEXT_S;
+        REG_WRITE(GPIO_OUT_W1TC_REG, 1u << s_wake_rows[r]);
+        uint8_t keys = 0;
+        for (uint8_t c = 0; c < s_wake_cols_len; c++) {
+            if (in & (1u << s_wake_cols[c])) keys |= 1 << c;
+        }
+        s_wake_keys[r] = keys;
+    }
+}
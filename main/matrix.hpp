@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+namespace matrix {
+    struct Event {
+        uint8_t row;
+        uint8_t col;
+        bool pressed;
+    };
+
+    // Called from the scan task, once per scan that changed any debounced key
+    typedef void (*Callback)(const Event *events, uint8_t count);
+
+    void setup(const int *rows, uint8_t rows_len, const int *cols, uint8_t cols_len, Callback cb);
+    // Every key is up and the scan waits on the column interrupt with all rows driven
+    bool parked();
+    // Rows stay driven through deep sleep and any column, or a pin in `extra`, wakes the chip
+    void armDeepWake(uint64_t extra);
+    // After a deep sleep wake, the keys found down straight out of sleep as presses; setup()
+    // starts them out held so their release is scanned as usual. Returns how many.
+    uint8_t wakeKeys(Event *events);
+}
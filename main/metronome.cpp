@@ -1,8 +1,14 @@
 #include "metronome.hpp"
+#include "click.hpp"
+#include "power.hpp"
 
 extern "C" {
+    #include <freertos/FreeRTOS.h>
+    #include <class/hid/hid.h>
     #include <driver/ledc.h>
     #include <driver/gpio.h>
+    #include <esp_timer.h>
+    #include <esp_log.h>
 }
 
 #define BUZZER_TIMER LEDC_TIMER_0
@@ -12,6 +18,282 @@ extern "C" {
 #define BUZZUER_CH LEDC_CHANNEL_0
 #define BUZZER_PIN 8
 
+namespace metronome {
+
+static const char *TAG = "METRONOME";
+
+constexpr uint32_t BPM_MIN = 20;
+constexpr uint32_t BPM_MAX = 300;
+constexpr uint8_t BEATS_MAX = 12;
+constexpr uint8_t SUB_MAX = 4;
+// A callback this early is a stale arm from before a re-anchor, not the tick
+constexpr int64_t EARLY_US = 200;
+
+constexpr int64_t TAP_RESET_US = 2 * 1000 * 1000;
+constexpr uint8_t TAPS = 4;
+
+enum class Accent : uint8_t {
+    DOWNBEAT,   // first beat of the bar
+    COMPOUND,   // every third beat, e.g. 6/8
+    ALL,
+    NONE,
+};
+
+static const char *accent_str[] = { "downbeat", "compound", "all", "none" };
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_beat_timer = nullptr;
+static esp_timer_handle_t s_envelope_timer = nullptr;
+// Held while running: LEDC is clocked from APB, and the clicks have to land on time
+static esp_pm_lock_handle_t s_pm = nullptr;
+
+// Tick n since the anchor is due at t0 + tickUs(n); nothing accumulates, so no drift.
+// A tick is a beat, or a subdivision of one when sub > 1.
+static bool running = false;
+static int64_t t0 = 0;
+static uint32_t next = 0;
+static uint8_t first = 0;   // bar position of tick 0, always on a beat
+static uint32_t bpm_x100 = 120 * 100;
+static uint8_t beats = 4;
+static uint8_t sub = 1;
+static Accent accent = Accent::DOWNBEAT;
+static int64_t late_max_us = 0;
+
+// Owned by HidTask
+static uint16_t entry = 0;
+static uint8_t entry_digits = 0;
+static int64_t taps[TAPS] = {};
+static uint8_t tap_count = 0;
+
+// Sound being played and its next envelope segment, owned by the esp_timer task
+static const click::Sound *s_sound = nullptr;
+static uint8_t s_segment = 0;
+
+static int64_t due(uint32_t n) {
+    return t0 + tickUs(n, bpm_x100, sub);
+}
+
+static bool accented(uint8_t beat) {
+    switch (accent) {
+        case Accent::DOWNBEAT: return beat == 0;
+        case Accent::COMPOUND: return beat % 3 == 0;
+        case Accent::ALL: return true;
+        default: return false;
+    }
+}
+
+static void arm(int64_t at) {
+    int64_t wait = at - esp_timer_get_time();
+    esp_timer_stop(s_beat_timer);
+    esp_timer_start_once(s_beat_timer, wait > 0 ? wait : 0);
+}
+
+// The fade engine ramps the duty; we only step in once per segment
+static void envelope_cb(void*) {
+    if (s_segment >= s_sound->len) return;
+    const click::Segment &seg = s_sound->seg[s_segment++];
+    ledc_set_fade_with_time(BUZZER_MODE, BUZZUER_CH, seg.duty, seg.ms);
+    ledc_fade_start(BUZZER_MODE, BUZZUER_CH, LEDC_FADE_NO_WAIT);
+    esp_timer_stop(s_envelope_timer);
+    esp_timer_start_once(s_envelope_timer, seg.ms * 1000);
+}
+
+static void play(const click::Sound &sound) {
+    ledc_fade_stop(BUZZER_MODE, BUZZUER_CH);
+    ledc_set_freq(BUZZER_MODE, BUZZER_TIMER, sound.hz);
+    s_sound = &sound;
+    s_segment = 0;
+    envelope_cb(nullptr);
+}
+
+static void beat_cb(void*) {
+    const int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&s_lock);
+    if (!running) {
+        taskEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    int64_t at = due(next);
+    if (now + EARLY_US < at) {
+        taskEXIT_CRITICAL(&s_lock);
+        arm(at);
+        return;
+    }
+    if (now - at > late_max_us) late_max_us = now - at;
+    const uint8_t pos = (first + next) % (beats * sub);
+    const click::Sound &sound = pos % sub ? click::SUB : accented(pos / sub) ? click::ACCENT : click::BEAT;
+    next++;
+    at = due(next);
+    taskEXIT_CRITICAL(&s_lock);
+
+    play(sound);
+    arm(at);
+}
+
+// Move the anchor to the last beat played, so a change applies from there on.
+// Call with the lock held, then set next with resync() once the new settings are in.
+static void reanchor() {
+    if (!running || !next) return;
+    const uint32_t last = next - 1;
+    const uint8_t pos = (first + last) % (beats * sub);
+    t0 = due(last - pos % sub);
+    first = pos - pos % sub;
+}
+
+// Next tick to play after now under the current settings; the anchor has already sounded
+static int64_t resync() {
+    if (!running) return 0;
+    const int64_t elapsed = esp_timer_get_time() - t0;
+    next = elapsed < 0 ? 0 : elapsed * bpm_x100 * sub / US_PER_MIN_X100 + 1;
+    return due(next);
+}
+
+static void set_tempo(uint32_t x100) {
+    x100 = x100 < BPM_MIN * 100 ? BPM_MIN * 100 : x100 > BPM_MAX * 100 ? BPM_MAX * 100 : x100;
+    taskENTER_CRITICAL(&s_lock);
+    reanchor();
+    bpm_x100 = x100;
+    const int64_t at = resync();
+    taskEXIT_CRITICAL(&s_lock);
+    if (at) arm(at);
+    ESP_LOGI(TAG, "%" PRIu32 ".%02" PRIu32 " BPM", x100 / 100, x100 % 100);
+}
+
+static void start_stop() {
+    taskENTER_CRITICAL(&s_lock);
+    running = !running;
+    t0 = esp_timer_get_time();
+    next = 0;
+    first = 0;
+    const bool on = running;
+    const int64_t late = late_max_us;
+    late_max_us = 0;
+    taskEXIT_CRITICAL(&s_lock);
+    if (on) {
+        power::acquire(s_pm);
+        arm(t0);
+        ESP_LOGI(TAG, "start: %" PRIu32 " BPM, %u beats per bar, %u ticks per beat, %s accents",
+            bpm_x100 / 100, beats, sub, accent_str[(uint8_t)accent]);
+    } else {
+        esp_timer_stop(s_beat_timer);
+        power::release(s_pm);
+        ESP_LOGI(TAG, "stop: worst tick %" PRId64 " us late", late);
+    }
+}
+
+static void set_meter(uint16_t n, uint16_t per_beat) {
+    if (n < 1 || n > BEATS_MAX || per_beat < 1 || per_beat > SUB_MAX) return;
+    taskENTER_CRITICAL(&s_lock);
+    reanchor();
+    first = first / sub % n * per_beat;
+    beats = n;
+    sub = per_beat;
+    const int64_t at = resync();
+    taskEXIT_CRITICAL(&s_lock);
+    if (at) arm(at);
+    ESP_LOGI(TAG, "%u beats per bar, %u ticks per beat", n, per_beat);
+}
+
+static void next_accent() {
+    taskENTER_CRITICAL(&s_lock);
+    accent = (Accent)(((uint8_t)accent + 1) % 4);
+    const Accent a = accent;
+    taskEXIT_CRITICAL(&s_lock);
+    ESP_LOGI(TAG, "%s accents", accent_str[(uint8_t)a]);
+}
+
+// Tempo from the average of the last few tap intervals; the last tap becomes a downbeat
+static void tap(int64_t us) {
+    if (tap_count && us - taps[(tap_count - 1) % TAPS] > TAP_RESET_US) tap_count = 0;
+    taps[tap_count % TAPS] = us;
+    tap_count++;
+    if (tap_count < 2) return;
+
+    const uint8_t n = tap_count < TAPS ? tap_count : TAPS;
+    const int64_t span = us - taps[(tap_count - n) % TAPS];
+    uint32_t x100 = US_PER_MIN_X100 * (n - 1) / span;
+    x100 = x100 < BPM_MIN * 100 ? BPM_MIN * 100 : x100 > BPM_MAX * 100 ? BPM_MAX * 100 : x100;
+    taskENTER_CRITICAL(&s_lock);
+    bpm_x100 = x100;
+    t0 = us;
+    first = 0;
+    const int64_t at = resync();
+    taskEXIT_CRITICAL(&s_lock);
+    if (at) arm(at);
+    ESP_LOGI(TAG, "tap: %" PRIu32 ".%02" PRIu32 " BPM", x100 / 100, x100 % 100);
+}
+
+static int digit(uint8_t usage) {
+    if (usage >= HID_KEY_KEYPAD_1 && usage <= HID_KEY_KEYPAD_9) return usage - HID_KEY_KEYPAD_1 + 1;
+    if (usage == HID_KEY_KEYPAD_0) return 0;
+    return -1;
+}
+
+// Digits then ENTER sets the tempo, digits then '.' the beats per bar, a bare '.' cycles accents.
+// TAB taps the tempo, or after digits sets the ticks per beat. +/- nudge the tempo, MUTE starts and stops.
+void key(uint8_t usage, int64_t us) {
+    const int d = digit(usage);
+    if (d >= 0) {
+        if (entry_digits < 3) {
+            entry = entry * 10 + d;
+            entry_digits++;
+        }
+        return;
+    }
+    const uint16_t value = entry;
+    const bool typed = entry_digits;
+    entry = 0;
+    entry_digits = 0;
+
+    switch (usage) {
+        case HID_KEY_ENTER:
+            if (typed) set_tempo(value * 100);
+            break;
+        case HID_KEY_KEYPAD_DECIMAL:
+            if (typed) {
+                set_meter(value, sub);
+            } else {
+                next_accent();
+            }
+            break;
+        case HID_KEY_TAB:
+            if (typed) {
+                set_meter(beats, value);
+            } else {
+                tap(us);
+            }
+            break;
+        case HID_KEY_KEYPAD_ADD:
+            set_tempo((bpm_x100 / 100 + 1) * 100);
+            break;
+        case HID_KEY_KEYPAD_SUBTRACT:
+            set_tempo((bpm_x100 / 100 - 1) * 100);
+            break;
+        case HID_KEY_MUTE:
+            start_stop();
+            break;
+    }
+}
+
+Phase phase(int64_t now) {
+    Phase p = {};
+    taskENTER_CRITICAL(&s_lock);
+    p.running = running;
+    p.beats = beats;
+    if (running) {
+        const int64_t elapsed = now > t0 ? now - t0 : 0;
+        const int64_t scaled = elapsed * bpm_x100 * sub;
+        const uint8_t pos = (first + scaled / US_PER_MIN_X100) % (beats * sub);
+        p.beat = pos / sub;
+        p.frac = ((pos % sub) * US_PER_MIN_X100 + scaled % US_PER_MIN_X100) * 256 / (US_PER_MIN_X100 * sub);
+        p.accent = accented(p.beat);
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    return p;
+}
+
+}
+
 void setupMetronome() {
     ledc_timer_config_t tcfg = {
         .speed_mode = BUZZER_MODE,
@@ -36,4 +318,19 @@ void setupMetronome() {
         },
     };
     ESP_ERROR_CHECK(ledc_channel_config(&ccfg));
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+
+    // Beats fire from the esp_timer task straight off the hardware timer, not the tick
+    esp_timer_create_args_t args = {
+        .callback = metronome::beat_cb,
+        .arg = nullptr,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "beat",
+        .skip_unhandled_events = false,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &metronome::s_beat_timer));
+    args.callback = metronome::envelope_cb;
+    args.name = "envelope";
+    ESP_ERROR_CHECK(esp_timer_create(&args, &metronome::s_envelope_timer));
+    metronome::s_pm = power::lock(ESP_PM_APB_FREQ_MAX, "buzzer");
 }
@@ -1,3 +1,28 @@
 #pragma once
 
+#include <cstdint>
+
 void setupMetronome();
+
+namespace metronome {
+    struct Phase {
+        bool running;
+        bool accent;
+        uint8_t beat;   // position in the bar
+        uint8_t beats;  // beats per bar
+        uint8_t frac;   // progress through the current beat, 0..255
+    };
+
+    // Tempo is kept in centi-BPM so tap tempo isn't rounded to whole BPM
+    constexpr int64_t US_PER_MIN_X100 = 60LL * 1000 * 1000 * 100;
+
+    // Tick n after the anchor, with sub ticks per beat
+    constexpr int64_t tickUs(uint32_t n, uint32_t bpm_x100, uint8_t sub) {
+        return (int64_t)n * US_PER_MIN_X100 / ((int64_t)bpm_x100 * sub);
+    }
+
+    // Key input in BootMode::METRONOME, with the usage the base layer gives the key
+    void key(uint8_t usage, int64_t us);
+    // Derived from the same anchor the beats are scheduled on, so lights stay locked to the clicks
+    Phase phase(int64_t now);
+}
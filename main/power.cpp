@@ -0,0 +1,69 @@
+#include "power.hpp"
+
+extern "C" {
+    #include <sdkconfig.h>
+    #include <freertos/FreeRTOS.h>
+    #include <freertos/task.h>
+    #include <esp_timer.h>
+    #include <esp_log.h>
+}
+
+#include <cstdio>
+
+static const char *TAG = "POWER";
+
+#ifdef CONFIG_KEYBOARD_PM_REPORT
+// Raw dumps on the console; host/pm_report turns a captured log into residency and current
+static void PowerTask(void*) {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_KEYBOARD_PM_REPORT_S * 1000));
+        ESP_LOGI(TAG, "pm dump at %lld ms", esp_timer_get_time() / 1000);
+        esp_pm_dump_locks(stdout);
+    }
+}
+#endif
+
+void setupPower() {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_config_t cfg = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&cfg));
+    ESP_LOGI(TAG, "%d-%d MHz, automatic light sleep", cfg.min_freq_mhz, cfg.max_freq_mhz);
+#else
+    ESP_LOGI(TAG, "power management disabled");
+#endif
+#ifdef CONFIG_KEYBOARD_PM_REPORT
+    xTaskCreatePinnedToCore(
+        PowerTask,
+        "PowerTask",
+        3072,
+        nullptr,
+        1,
+        nullptr,
+        tskNO_AFFINITY
+    );
+#endif
+}
+
+namespace power {
+
+esp_pm_lock_handle_t lock(esp_pm_lock_type_t type, const char *name) {
+    esp_pm_lock_handle_t handle = nullptr;
+#ifdef CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(type, 0, name, &handle));
+#endif
+    return handle;
+}
+
+void acquire(esp_pm_lock_handle_t lock) {
+    if (lock) esp_pm_lock_acquire(lock);
+}
+
+void release(esp_pm_lock_handle_t lock) {
+    if (lock) esp_pm_lock_release(lock);
+}
+
+}
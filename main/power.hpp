@@ -0,0 +1,15 @@
+#pragma once
+
+extern "C" {
+    #include <esp_pm.h>
+}
+
+// DFS between the XTAL and the default CPU clock, with automatic light sleep when every task is blocked
+void setupPower();
+
+namespace power {
+    // Without CONFIG_PM_ENABLE the handle is null and acquire/release do nothing
+    esp_pm_lock_handle_t lock(esp_pm_lock_type_t type, const char *name);
+    void acquire(esp_pm_lock_handle_t lock);
+    void release(esp_pm_lock_handle_t lock);
+}
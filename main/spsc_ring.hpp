@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock-free ring for exactly one producer task and one consumer task.
+// push() never blocks: a full ring counts an overflow and drops the item.
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N && !(N & (N - 1)), "SpscRing size must be a power of two");
+
+public:
+    bool push(const T &item) {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+        const uint32_t depth = h - tail.load(std::memory_order_acquire);
+        if (depth == N) {
+            overflow.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        buf[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        if (depth + 1 > highWater.load(std::memory_order_relaxed)) {
+            highWater.store(depth + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool pop(T &item) {
+        const uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = buf[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Exact from the consumer; the producer may only have added to it since
+    uint32_t depth() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+    }
+
+    uint32_t overflows() const {
+        return overflow.load(std::memory_order_relaxed);
+    }
+
+    uint32_t depthHighWater() const {
+        return highWater.load(std::memory_order_relaxed);
+    }
+
+private:
+    T buf[N];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> overflow{0};
+    std::atomic<uint32_t> highWater{0};
+};
@@ -1,9 +1,11 @@
 #include "usb_hid.hpp"
 
 extern "C" {
+    #include <sdkconfig.h>
     #include <tinyusb.h>
     #include <tinyusb_default_config.h>
     #include <class/hid/hid_device.h>
+    #include <freertos/FreeRTOS.h>
     #include <driver/gpio.h>
     #include <esp_log.h>
 }
@@ -15,15 +17,78 @@ namespace usb_hid {
 static const char *TAG = "USB_HID";
 
 static bool active = false;
+static bool dirty = false;
+static void (*s_protocol)() = nullptr;
 
-static uint8_t modifiers = 0;
-static uint8_t keycodes[6] = {0};
-static uint8_t keycodes_len = sizeof(keycodes) / sizeof(keycodes[0]);
+// NKRO bitmap over usages 0x00..0xDF, modifiers 0xE0..0xE7 go in their own byte
+constexpr uint8_t NKRO_USAGES = 0xE0;
+constexpr uint8_t NKRO_BYTES = NKRO_USAGES / 8;
+
+struct Report {
+    uint8_t modifiers;
+    uint8_t bits[NKRO_BYTES];
+};
+
+static Report state = {};
+
+// Reports waiting for the IN endpoint, drained from tud_hid_report_complete_cb
+constexpr uint8_t QUEUE_LEN = 8;
+static Report queue[QUEUE_LEN];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+
+enum class Ep : uint8_t {
+    IDLE,
+    CLAIMED,
+    BUSY,
+};
+
+static Ep ep = Ep::IDLE;
+static Stats s_stats = {};
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
 
 #define TUSB_DESC_TOTAL_LEN      (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
 
+#ifdef CONFIG_KEYBOARD_USB_POLL_1KHZ
+#define POLL_INTERVAL_MS 1
+#else
+#define POLL_INTERVAL_MS 10
+#endif
+
 const uint8_t hid_report_descriptor[] = {
-    TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(HID_ITF_PROTOCOL_KEYBOARD)),
+    HID_USAGE_PAGE(HID_USAGE_PAGE_DESKTOP),
+    HID_USAGE(HID_USAGE_DESKTOP_KEYBOARD),
+    HID_COLLECTION(HID_COLLECTION_APPLICATION),
+        HID_REPORT_ID(HID_ITF_PROTOCOL_KEYBOARD)
+        // 8 bits Modifier Keys
+        HID_USAGE_PAGE(HID_USAGE_PAGE_KEYBOARD),
+        HID_USAGE_MIN(0xE0),
+        HID_USAGE_MAX(0xE7),
+        HID_LOGICAL_MIN(0),
+        HID_LOGICAL_MAX(1),
+        HID_REPORT_COUNT(8),
+        HID_REPORT_SIZE(1),
+        HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),
+        // 5 bits LED Indicator Kana | Compose | ScrollLock | CapsLock | NumLock
+        HID_USAGE_PAGE(HID_USAGE_PAGE_LED),
+        HID_USAGE_MIN(1),
+        HID_USAGE_MAX(5),
+        HID_REPORT_COUNT(5),
+        HID_REPORT_SIZE(1),
+        HID_OUTPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),
+        HID_REPORT_COUNT(1),
+        HID_REPORT_SIZE(3),
+        HID_OUTPUT(HID_CONSTANT),
+        // One bit per usage
+        HID_USAGE_PAGE(HID_USAGE_PAGE_KEYBOARD),
+        HID_USAGE_MIN(0x00),
+        HID_USAGE_MAX(NKRO_USAGES - 1),
+        HID_LOGICAL_MIN(0),
+        HID_LOGICAL_MAX(1),
+        HID_REPORT_COUNT(NKRO_USAGES),
+        HID_REPORT_SIZE(1),
+        HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),
+    HID_COLLECTION_END,
 };
 
 const char *hid_string_descriptor[5] = {
@@ -40,25 +105,18 @@ static const uint8_t hid_configuration_descriptor[] = {
     TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
     // Interface number, string index, boot protocol, report descriptor len, EP In address, size & polling interval
-    TUD_HID_DESCRIPTOR(0, 4, false, sizeof(hid_report_descriptor), 0x81, 16, 10),
+    TUD_HID_DESCRIPTOR(0, 4, HID_ITF_PROTOCOL_KEYBOARD, sizeof(hid_report_descriptor), 0x81, 32, POLL_INTERVAL_MS),
 };
 
-void setup(char serial_str[17]) {
+void setup(char serial_str[17], void (*protocol)()) {
     if (active) return;
 
     ESP_LOGI(TAG, "Setting up USB HID");
 
     hid_string_descriptor[3] = serial_str;
+    s_protocol = protocol;
 
-    gpio_reset_pin(VBUS_MONITOR_IO);
-    gpio_config_t io = {
-        .pin_bit_mask = 1ULL << VBUS_MONITOR_IO,
-        .mode = GPIO_MODE_INPUT,
-        .pull_up_en = GPIO_PULLUP_DISABLE,
-        .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE,
-    };
-    gpio_config(&io);
+    // The pin itself is configured by setupKeyboard, which also owns its edge interrupt
     gpio_set_drive_capability(VBUS_MONITOR_IO, GPIO_DRIVE_CAP_0);
 
     tinyusb_config_t tusb_cfg = TINYUSB_DEFAULT_CONFIG();
@@ -74,43 +132,132 @@ void setup(char serial_str[17]) {
     ESP_LOGI(TAG, "USB HID setup complete");
 }
 
+// Serialize for whichever protocol the host selected
+static bool transmit(const Report &r) {
+    if (tud_hid_get_protocol() == HID_PROTOCOL_REPORT) {
+        return tud_hid_report(HID_ITF_PROTOCOL_KEYBOARD, &r, sizeof(r));
+    }
+    uint8_t keycodes[6] = {0};
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < NKRO_BYTES; i++) {
+        for (uint8_t b = r.bits[i]; b; b &= b - 1) {
+            if (n == sizeof(keycodes)) {
+                // Boot protocol can't express it: ErrorRollOver in every slot
+                memset(keycodes, 0x01, sizeof(keycodes));
+                return tud_hid_keyboard_report(0, r.modifiers, keycodes);
+            }
+            keycodes[n++] = i * 8 + __builtin_ctz(b);
+        }
+    }
+    return tud_hid_keyboard_report(0, r.modifiers, keycodes);
+}
+
 void end() {
     if (!active) return;
     active = false;
 
-    memset(keycodes, 0, sizeof(keycodes));
+    state = {};
     if (tud_mounted()) {
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifiers, keycodes);
+        transmit(state);
         tud_disconnect();
     }
     tinyusb_driver_uninstall();
-    ESP_LOGI(TAG, "USB HID ended");
+
+    taskENTER_CRITICAL(&s_lock);
+    queue_head = 0;
+    queue_count = 0;
+    ep = Ep::IDLE;
+    taskEXIT_CRITICAL(&s_lock);
+
+    ESP_LOGI(
+        TAG, "USB HID ended; sent=%" PRIu32 " merged=%" PRIu32 " dropped=%" PRIu32 " hwm=%u",
+        s_stats.sent, s_stats.merged, s_stats.dropped, s_stats.highWater
+    );
 }
 
-void press(const uint8_t key) {
-    if (!tud_ready()) return;
+// Send the oldest queued report if the endpoint is free
+static void kick() {
+    Report r;
+    taskENTER_CRITICAL(&s_lock);
+    if (ep == Ep::BUSY && tud_hid_ready()) {
+        // The completion raced ahead of us, or the transfer was aborted by a bus reset
+        ep = Ep::IDLE;
+    }
+    if (ep != Ep::IDLE || queue_count == 0) {
+        taskEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    r = queue[queue_head];
+    queue_head = (queue_head + 1) % QUEUE_LEN;
+    queue_count--;
+    ep = Ep::CLAIMED;
+    taskEXIT_CRITICAL(&s_lock);
 
-    for (auto i = 0; i < keycodes_len; i++) {
-        if (keycodes[i] == key) {
-            return;
-        }
-        if (keycodes[i] == 0) {
-            keycodes[i] = key;
-            break;
+    bool ok = transmit(r);
+
+    taskENTER_CRITICAL(&s_lock);
+    if (ok) {
+        s_stats.sent++;
+        if (ep == Ep::CLAIMED) ep = Ep::BUSY;
+    } else {
+        // Put it back in front; if the queue filled meanwhile, newer states supersede it
+        if (queue_count < QUEUE_LEN) {
+            queue_head = (queue_head + QUEUE_LEN - 1) % QUEUE_LEN;
+            queue[queue_head] = r;
+            queue_count++;
+        } else {
+            s_stats.merged++;
         }
+        ep = Ep::IDLE;
     }
-    tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifiers, keycodes);
+    taskEXIT_CRITICAL(&s_lock);
 }
 
-void release(const uint8_t key) {
+bool ready() {
+    return tud_ready();
+}
+
+void send(const KeyState &keys) {
+    Report r = {keys.modifiers, {}};
+    memcpy(r.bits, keys.bits, NKRO_BYTES);
+    if (!dirty && !memcmp(&r, &state, sizeof(r))) return;
+    state = r;
+    dirty = true;
     if (!tud_ready()) return;
+    dirty = false;
 
-    for (auto i = 0; i < keycodes_len; i++) {
-        if (keycodes[i] == key) {
-            keycodes[i] = 0;
+    taskENTER_CRITICAL(&s_lock);
+    if (queue_count < QUEUE_LEN) {
+        queue[(queue_head + queue_count) % QUEUE_LEN] = r;
+        queue_count++;
+        if (queue_count > s_stats.highWater) s_stats.highWater = queue_count;
+    } else {
+        // Backed up: fold into the newest entry. A key pressed in that entry and
+        // released again in this one would never reach the host, so count it.
+        auto &tail = queue[(queue_head + QUEUE_LEN - 1) % QUEUE_LEN];
+        auto &prev = queue[(queue_head + QUEUE_LEN - 2) % QUEUE_LEN];
+        for (uint8_t i = 0; i < NKRO_BYTES; i++) {
+            s_stats.dropped += __builtin_popcount(tail.bits[i] & ~r.bits[i] & ~prev.bits[i]);
         }
+        tail = r;
+        s_stats.merged++;
     }
-    tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifiers, keycodes);
+    taskEXIT_CRITICAL(&s_lock);
+
+    kick();
+}
+
+void replay(const KeyState &keys) {
+    dirty = true;
+    send(keys);
+}
+
+uint32_t frameUs() {
+    return POLL_INTERVAL_MS * 1000;
+}
+
+const Stats &stats() {
+    return s_stats;
 }
 
 }
@@ -127,6 +274,29 @@ uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
     return usb_hid::hid_report_descriptor;
 }
 
+// Invoked when a report was sent to the host; the endpoint is free again
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len)
+{
+    (void) instance;
+    (void) report;
+    (void) len;
+
+    taskENTER_CRITICAL(&usb_hid::s_lock);
+    usb_hid::ep = usb_hid::Ep::IDLE;
+    taskEXIT_CRITICAL(&usb_hid::s_lock);
+    usb_hid::kick();
+}
+
+// Invoked when the host switches between boot and report protocol (SET_PROTOCOL)
+void tud_hid_set_protocol_cb(uint8_t instance, uint8_t protocol)
+{
+    (void) instance;
+
+    ESP_LOGI(usb_hid::TAG, "protocol: %s", protocol == HID_PROTOCOL_BOOT ? "BOOT" : "REPORT");
+    // The held keys go out again in the new format, from the task that owns the report state
+    if (usb_hid::s_protocol) usb_hid::s_protocol();
+}
+
 // Invoked when received GET_REPORT control request
 // Application must fill buffer report's content and return its length.
 // Return zero will cause the stack to STALL request
@@ -1,10 +1,23 @@
 #pragma once
 
 #include <cstdint>
+#include "key_state.hpp"
 
 namespace usb_hid {
-    void setup(char serial_str[17]);
+    struct Stats {
+        uint32_t sent;
+        uint32_t merged;   // queued states folded into a newer one
+        uint32_t dropped;  // taps lost to a merge
+        uint8_t highWater;
+    };
+
+    // protocol() runs on the TinyUSB task when the host switches between boot and report protocol
+    void setup(char serial_str[17], void (*protocol)());
     void end();
-    void press(const uint8_t key);
-    void release(const uint8_t key);
+    bool ready();
+    void send(const KeyState &keys);
+    void replay(const KeyState &keys);
+    // Shortest spacing between reports the link delivers
+    uint32_t frameUs();
+    const Stats &stats();
 }